@@ -0,0 +1,389 @@
+#ifndef ACCUMULATION_FILE_H
+#define ACCUMULATION_FILE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BoundingBox.h"
+#include "Image.h"
+#include "MappedFile.h"
+
+/**
+ * File of an image's raw accumulation, the counts and color sums of every
+ * pixel before brightening, so that it can be exposed and graded elsewhere
+ * or summed with renders of the same config made by other processes.
+ * Empty pixels are skipped and values are variable length, so sparse
+ * renders make small files. Little-endian:
+ *
+ *     "IFSACCUM"              magic
+ *     uint32 version          2
+ *     uint32 width
+ *     uint32 height
+ *     uint64 configHash       see Config::getFileHash()
+ *     double minX, minY, maxX, maxY
+ *     uint64 iterationCount   across all threads
+ *     uint64 rowOffsets[height + 1]
+ *     for each row, from the top:
+ *         varint runCount
+ *         for each run of non-empty pixels:
+ *             varint gap      empty pixels since the previous run
+ *             varint length
+ *             for each pixel: varint red, green and blue sums, and count
+ *
+ * The row offsets are from the start of the file, the last one being the
+ * end of the last row, so rows can be decoded in parallel.
+ *
+ * Varints are unsigned LEB128: seven bits at a time, lowest first, with the
+ * high bit set on all but the last byte.
+ */
+class AccumulationFile {
+    static const uint32_t VERSION = 2;
+    static const int HEADER_SIZE = 68;
+
+public:
+    // What was rendered, to check that files can be merged.
+    struct Header {
+        uint64_t configHash = 0;
+        BoundingBox bbox;
+        uint64_t iterationCount = 0;
+    };
+
+    /**
+     * Write the image, which must not have been brightened, returning
+     * whether successful. The header's bounding box must be set.
+     */
+    static bool write(const std::string &pathname, const Image &image, Header const &header) {
+        FILE *f = fopen(pathname.c_str(), "wb");
+        if (f == nullptr) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        int height = image.getHeight();
+        std::vector<uint8_t> bytes = { 'I', 'F', 'S', 'A', 'C', 'C', 'U', 'M' };
+        appendUint(bytes, VERSION, 4);
+        appendUint(bytes, image.getWidth(), 4);
+        appendUint(bytes, height, 4);
+        appendUint(bytes, header.configHash, 8);
+        appendDouble(bytes, header.bbox.getMinX());
+        appendDouble(bytes, header.bbox.getMinY());
+        appendDouble(bytes, header.bbox.getMaxX());
+        appendDouble(bytes, header.bbox.getMaxY());
+        appendUint(bytes, header.iterationCount, 8);
+        fwrite(&bytes[0], 1, bytes.size(), f);
+
+        // Fill in the row offsets once the rows are written.
+        std::vector<uint64_t> offsets;
+        uint64_t offset = HEADER_SIZE + (uint64_t) (height + 1)*8;
+        fseek(f, offset, SEEK_SET);
+        writeRows(f, image, [&offsets, &offset](uint64_t rowSize) {
+            offsets.push_back(offset);
+            offset += rowSize;
+        });
+        offsets.push_back(offset);
+
+        bytes.clear();
+        for (uint64_t rowOffset : offsets) {
+            appendUint(bytes, rowOffset, 8);
+        }
+        fseek(f, HEADER_SIZE, SEEK_SET);
+        fwrite(&bytes[0], 1, bytes.size(), f);
+
+        bool success = !ferror(f);
+        return fclose(f) == 0 && success;
+    }
+
+    /**
+     * Sum files of the same config, bounding box and size, each
+     * mapped into memory, into a new image with "threadCount" threads,
+     * each decoding a band of rows of every file. Fills in the header,
+     * with the total iteration count. Returns null on error.
+     */
+    static std::unique_ptr<Image> merge(std::vector<std::string> const &pathnames,
+            Header &header, int threadCount) {
+
+        std::vector<std::unique_ptr<MappedFile>> files;
+        int width = 0;
+        int height = 0;
+        for (unsigned i = 0; i < pathnames.size(); i++) {
+            files.emplace_back(std::make_unique<MappedFile>());
+            if (!files.back()->open(pathnames[i])) {
+                return nullptr;
+            }
+
+            int fileWidth, fileHeight;
+            Header fileHeader;
+            if (!parseHeader(files.back()->getData(), files.back()->getSize(),
+                        fileWidth, fileHeight, fileHeader)) {
+
+                std::cerr << "Invalid accumulation file: " << pathnames[i] << std::endl;
+                return nullptr;
+            }
+
+            if (i == 0) {
+                width = fileWidth;
+                height = fileHeight;
+                header = fileHeader;
+            } else if (fileWidth != width || fileHeight != height ||
+                    fileHeader.configHash != header.configHash ||
+                    !sameBbox(fileHeader.bbox, header.bbox)) {
+
+                std::cerr << pathnames[i] << " is of a different render than "
+                    << pathnames[0] << std::endl;
+                return nullptr;
+            } else {
+                header.iterationCount += fileHeader.iterationCount;
+            }
+        }
+
+        // Whole tiles, so that the bands are quick to add.
+        int bandHeight = (height + threadCount - 1)/threadCount;
+        bandHeight = (bandHeight + Image::TILE_SIZE - 1)/Image::TILE_SIZE*Image::TILE_SIZE;
+
+        std::vector<std::unique_ptr<Image>> bands;
+        std::vector<std::thread> threads;
+        std::atomic<bool> success(true);
+        for (int firstRow = 0; firstRow < height; firstRow += bandHeight) {
+            bands.emplace_back(std::make_unique<Image>(width,
+                        std::min(bandHeight, height - firstRow)));
+            threads.emplace_back(mergeBand, std::cref(files), firstRow,
+                    std::ref(*bands.back()), std::ref(success));
+        }
+
+        auto image = std::make_unique<Image>(width, height);
+        for (unsigned band = 0; band < bands.size(); band++) {
+            threads[band].join();
+            image->addRows(*bands[band], band*bandHeight);
+        }
+
+        if (!success) {
+            std::cerr << "Invalid rows in accumulation files." << std::endl;
+            return nullptr;
+        }
+        return image;
+    }
+
+    /**
+     * Write the rows of the image, which must not have been brightened,
+     * as in the file, for embedding in other files. "rowWritten" is called
+     * with the size of each row.
+     */
+    template <typename FUNC>
+    static void writeRows(FILE *f, const Image &image, FUNC rowWritten) {
+        int width = image.getWidth();
+        std::vector<uint8_t> bytes;
+        std::vector<uint64_t> row((uint64_t) width*4);
+
+        for (int y = 0; y < image.getHeight(); y++) {
+            image.readRow(y, &row[0]);
+
+            // Find the runs of non-empty pixels, as start and end.
+            std::vector<int> runs;
+            for (int x = 0; x < width; x++) {
+                if (row[x*4 + 3] != 0) {
+                    if (runs.empty() || runs.back() != x) {
+                        runs.push_back(x);
+                        runs.push_back(x + 1);
+                    } else {
+                        runs.back() = x + 1;
+                    }
+                }
+            }
+
+            bytes.clear();
+            appendVarint(bytes, runs.size()/2);
+            int previousEnd = 0;
+            for (unsigned run = 0; run < runs.size(); run += 2) {
+                appendVarint(bytes, runs[run] - previousEnd);
+                appendVarint(bytes, runs[run + 1] - runs[run]);
+                for (int x = runs[run]; x < runs[run + 1]; x++) {
+                    for (int i = 0; i < 4; i++) {
+                        appendVarint(bytes, row[x*4 + i]);
+                    }
+                }
+                previousEnd = runs[run + 1];
+            }
+            fwrite(&bytes[0], 1, bytes.size(), f);
+            rowWritten(bytes.size());
+        }
+    }
+
+    static void writeRows(FILE *f, const Image &image) {
+        writeRows(f, image, [](uint64_t) {});
+    }
+
+    /**
+     * Add rows written by writeRows(), between "p" and "end" of a file
+     * mapped into memory, to the empty image, returning whether successful.
+     */
+    static bool readRows(const uint8_t *p, const uint8_t *end, Image &image) {
+        for (int y = 0; y < image.getHeight(); y++) {
+            if (!decodeRow(p, end, image, y)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    /**
+     * Parse the header at the start of "data", returning whether it's
+     * valid: the size must be one that Image supports, and the row offsets
+     * and rows must be within the file.
+     */
+    static bool parseHeader(const uint8_t *data, uint64_t size,
+            int &width, int &height, Header &header) {
+
+        if (size < HEADER_SIZE || memcmp(data, "IFSACCUM", 8) != 0 ||
+                getUint(data + 8, 4) != VERSION) {
+
+            return false;
+        }
+
+        uint64_t fileWidth = getUint(data + 12, 4);
+        uint64_t fileHeight = getUint(data + 16, 4);
+        if (fileWidth == 0 || fileHeight == 0 ||
+                !Image::isSizeSupported(fileWidth, fileHeight) ||
+                size < HEADER_SIZE + (fileHeight + 1)*8) {
+
+            return false;
+        }
+        width = fileWidth;
+        height = fileHeight;
+
+        header.configHash = getUint(data + 20, 8);
+        header.bbox = BoundingBox(getDouble(data + 28), getDouble(data + 36),
+                getDouble(data + 44), getDouble(data + 52));
+        header.iterationCount = getUint(data + 60, 8);
+
+        // The rows must be within the file.
+        return getUint(data + HEADER_SIZE + (uint64_t) height*8, 8) <= size;
+    }
+
+    /**
+     * Add the rows of the files for the band, an image of the rows from
+     * "firstRow". Clears "success" if any are invalid.
+     */
+    static void mergeBand(std::vector<std::unique_ptr<MappedFile>> const &files, int firstRow,
+            Image &band, std::atomic<bool> &success) {
+
+        for (int y = 0; y < band.getHeight() && success; y++) {
+            for (auto const &file : files) {
+                const uint8_t *data = file->getData();
+                const uint8_t *offsets = data + HEADER_SIZE + (uint64_t) (firstRow + y)*8;
+                uint64_t start = getUint(offsets, 8);
+                uint64_t end = getUint(offsets + 8, 8);
+                const uint8_t *p = data + start;
+
+                if (start > end || end > file->getSize() ||
+                        !decodeRow(p, data + end, band, y)) {
+
+                    success = false;
+                    return;
+                }
+            }
+        }
+    }
+
+    /**
+     * Decode a row at "p", which is moved past it, and add its pixels to
+     * row "y" of the image. Returns whether successful.
+     */
+    static bool decodeRow(const uint8_t *&p, const uint8_t *end, Image &image, int y) {
+        uint64_t runCount;
+        if (!decodeVarint(p, end, runCount)) {
+            return false;
+        }
+
+        uint64_t x = 0;
+        for (uint64_t run = 0; run < runCount; run++) {
+            uint64_t gap, length;
+            if (!decodeVarint(p, end, gap) || !decodeVarint(p, end, length) ||
+                    x + gap + length > (uint64_t) image.getWidth()) {
+
+                return false;
+            }
+
+            x += gap;
+            for (uint64_t i = 0; i < length; i++, x++) {
+                uint64_t red, green, blue, count;
+                if (!decodeVarint(p, end, red) || !decodeVarint(p, end, green) ||
+                        !decodeVarint(p, end, blue) || !decodeVarint(p, end, count)) {
+
+                    return false;
+                }
+                image.addPoints(x, y, red, green, blue, count);
+            }
+        }
+
+        return true;
+    }
+
+    static bool decodeVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+        value = 0;
+
+        for (int shift = 0; shift < 64 && p < end; shift += 7) {
+            uint8_t byte = *p++;
+
+            value |= (uint64_t) (byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool sameBbox(BoundingBox const &a, BoundingBox const &b) {
+        return a.getMinX() == b.getMinX() && a.getMinY() == b.getMinY() &&
+            a.getMaxX() == b.getMaxX() && a.getMaxY() == b.getMaxY();
+    }
+
+    static void appendUint(std::vector<uint8_t> &v, uint64_t value, int size) {
+        for (int i = 0; i < size; i++) {
+            v.push_back(value >> i*8);
+        }
+    }
+
+    static void appendDouble(std::vector<uint8_t> &v, double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        appendUint(v, bits, 8);
+    }
+
+    static void appendVarint(std::vector<uint8_t> &v, uint64_t value) {
+        while (value >= 0x80) {
+            v.push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        v.push_back(value);
+    }
+
+    static uint64_t getUint(const uint8_t *data, int size) {
+        uint64_t value = 0;
+
+        for (int i = 0; i < size; i++) {
+            value |= (uint64_t) data[i] << i*8;
+        }
+
+        return value;
+    }
+
+    static double getDouble(const uint8_t *data) {
+        uint64_t bits = getUint(data, 8);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+
+        return value;
+    }
+};
+
+#endif // ACCUMULATION_FILE_H
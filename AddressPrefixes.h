@@ -0,0 +1,254 @@
+#ifndef ADDRESS_PREFIXES_H
+#define ADDRESS_PREFIXES_H
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "BoundingBox.h"
+#include "Config.h"
+#include "TransformAttractor.h"
+#include "util.h"
+
+/**
+ * For zooming into part of an attractor made only of affine maps. Every point
+ * of the attractor is the image of another point under some sequence of maps
+ * (an address prefix), chosen with the product of their probabilities. These
+ * are the sequences whose image of the whole attractor overlaps the zoomed
+ * view, so mapping ordinary orbit points through a random one of them, in
+ * proportion to its probability, lands almost every point in the view with
+ * the same density as a normal render.
+ */
+class AddressPrefixes {
+    // Refine a prefix until its image is this fraction of the view's size.
+    static constexpr double REFINE_FRACTION = 1.0/16;
+    static const int MAX_PREFIX_COUNT = 65536;
+    static const int MAX_DEPTH = 64;
+
+    struct Prefix {
+        // Composition of the maps, as { a, b, c, d, e, f } (see TransformAttractor).
+        double matrix[6];
+        // The point's color map value is scaled by this and then offset.
+        double colorScale;
+        double colorOffset;
+        // Attractor applied last, or -1 for the empty prefix.
+        int attractorIndex;
+        double probability;
+        int depth;
+    };
+
+    std::vector<Prefix> mPrefixes;
+    // Cumulative probability of the prefixes, normalized to end at 1.
+    std::vector<double> mCumulative;
+    // Total probability of the prefixes.
+    double mProbability;
+
+public:
+    /**
+     * Find the prefixes of the config's maps that overlap the view, or return
+     * null if the config isn't only affine maps.
+     */
+    static std::unique_ptr<AddressPrefixes> make(Config const &config, const BoundingBox &view) {
+        // Each step is the attractor then the variations, which are just a scale.
+        if (!config.variations().isLinear()) {
+            std::cerr << "Zooming needs configs with only the linear variation." << std::endl;
+            return nullptr;
+        }
+        double scale = config.variations().getLinearWeight();
+
+        AttractorSet const &attractorSet = config.attractorSet();
+        std::vector<Prefix> maps;
+        for (int i = 0; i < attractorSet.getCount(); i++) {
+            Attractor const &attractor = attractorSet.get(i);
+            auto transform = dynamic_cast<TransformAttractor const *>(&attractor);
+            if (transform == nullptr) {
+                std::cerr << "Zooming needs configs with only transform attractors." << std::endl;
+                return nullptr;
+            }
+
+            Prefix map;
+            transform->getMatrix(map.matrix);
+            for (double &coefficient : map.matrix) {
+                coefficient *= scale;
+            }
+            map.colorScale = 0.5;
+            map.colorOffset = attractor.getColorMapValue()/2;
+            map.attractorIndex = i;
+            map.probability = attractor.getProbability();
+            map.depth = 1;
+            maps.push_back(map);
+        }
+
+        auto prefixes = std::make_unique<AddressPrefixes>();
+        prefixes->findPrefixes(maps, findAttractorBounds(config), view);
+        if (prefixes->mPrefixes.empty()) {
+            std::cerr << "The zoomed view doesn't overlap the attractor." << std::endl;
+            return nullptr;
+        }
+
+        return prefixes;
+    }
+
+    int getCount() const {
+        return mPrefixes.size();
+    }
+
+    /**
+     * Fraction of the attractor's points that the prefixes cover.
+     */
+    double getProbability() const {
+        return mProbability;
+    }
+
+    /**
+     * Map an orbit point and its color map value through a random prefix.
+     * Returns the attractor applied last, or "attractorIndex" if none.
+     */
+    int transform(double &x, double &y, double &colorMapValue, int attractorIndex) const {
+        // Binary search for the prefix.
+        double r = my_randd();
+        int low = 0;
+        int high = mCumulative.size() - 1;
+        while (low < high) {
+            int middle = (low + high)/2;
+            if (mCumulative[middle] > r) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+
+        Prefix const &prefix = mPrefixes[low];
+        apply(prefix.matrix, x, y);
+        colorMapValue = colorMapValue*prefix.colorScale + prefix.colorOffset;
+
+        return prefix.attractorIndex == -1 ? attractorIndex : prefix.attractorIndex;
+    }
+
+private:
+    /**
+     * Strict bounds of the attractor, from an orbit, with some margin.
+     */
+    static BoundingBox findAttractorBounds(Config const &config) {
+        const int FUSE_LENGTH = 100;
+        const int SAMPLE_COUNT = 100000;
+
+        BoundingBox bbox;
+        double x = 0;
+        double y = 0;
+        for (int i = 0; i < FUSE_LENGTH + SAMPLE_COUNT; i++) {
+            config.attractorSet().choose().transform(x, y);
+            config.variations().transform(x, y);
+
+            if (i >= FUSE_LENGTH) {
+                bbox.grow(x, y);
+            }
+        }
+        bbox.growBy(0.05);
+
+        return bbox;
+    }
+
+    /**
+     * Refine the prefixes breadth first, starting from the empty one.
+     */
+    void findPrefixes(std::vector<Prefix> const &maps, const BoundingBox &bounds,
+            const BoundingBox &view) {
+
+        double viewSize = std::max(view.getWidth(), view.getHeight());
+
+        Prefix empty = { { 1, 0, 0, 1, 0, 0 }, 1, 0, -1, 1, 0 };
+        std::vector<Prefix> candidates = { empty };
+
+        while (!candidates.empty()) {
+            std::vector<Prefix> next;
+
+            for (unsigned i = 0; i < candidates.size(); i++) {
+                Prefix const &prefix = candidates[i];
+                BoundingBox image = getImage(prefix.matrix, bounds);
+
+                if (!image.intersects(view)) {
+                    continue;
+                }
+
+                // Keep prefixes that are already small or inside the view,
+                // and stop refining when there would be too many.
+                uint64_t count = mPrefixes.size() + next.size() +
+                    (candidates.size() - i - 1) + maps.size();
+                if (view.contains(image) ||
+                        std::max(image.getWidth(), image.getHeight()) < viewSize*REFINE_FRACTION ||
+                        prefix.depth == MAX_DEPTH || count > MAX_PREFIX_COUNT) {
+
+                    mPrefixes.push_back(prefix);
+                } else {
+                    for (Prefix const &map : maps) {
+                        next.push_back(compose(prefix, map));
+                    }
+                }
+            }
+
+            candidates.swap(next);
+        }
+
+        mProbability = 0;
+        for (Prefix const &prefix : mPrefixes) {
+            mProbability += prefix.probability;
+            mCumulative.push_back(mProbability);
+        }
+        for (double &cumulative : mCumulative) {
+            cumulative /= mProbability;
+        }
+    }
+
+    /**
+     * The prefix followed by one more map, which is applied first.
+     */
+    static Prefix compose(Prefix const &prefix, Prefix const &map) {
+        const double *m1 = prefix.matrix;
+        const double *m2 = map.matrix;
+        Prefix composed;
+
+        composed.matrix[0] = m1[0]*m2[0] + m1[1]*m2[2];
+        composed.matrix[1] = m1[0]*m2[1] + m1[1]*m2[3];
+        composed.matrix[2] = m1[2]*m2[0] + m1[3]*m2[2];
+        composed.matrix[3] = m1[2]*m2[1] + m1[3]*m2[3];
+        composed.matrix[4] = m1[0]*m2[4] + m1[1]*m2[5] + m1[4];
+        composed.matrix[5] = m1[2]*m2[4] + m1[3]*m2[5] + m1[5];
+
+        // The map's color is averaged in before the prefix's.
+        composed.colorScale = prefix.colorScale*map.colorScale;
+        composed.colorOffset = prefix.colorOffset + prefix.colorScale*map.colorOffset;
+
+        composed.attractorIndex = prefix.depth == 0 ? map.attractorIndex : prefix.attractorIndex;
+        composed.probability = prefix.probability*map.probability;
+        composed.depth = prefix.depth + 1;
+
+        return composed;
+    }
+
+    static void apply(const double *matrix, double &x, double &y) {
+        double newX = matrix[0]*x + matrix[1]*y + matrix[4];
+        double newY = matrix[2]*x + matrix[3]*y + matrix[5];
+
+        x = newX;
+        y = newY;
+    }
+
+    /**
+     * Bounds of the image of the box under the matrix.
+     */
+    static BoundingBox getImage(const double *matrix, const BoundingBox &bbox) {
+        BoundingBox image;
+
+        for (int corner = 0; corner < 4; corner++) {
+            double x = bbox.getXCenter() + (corner & 1 ? 0.5 : -0.5)*bbox.getWidth();
+            double y = bbox.getYCenter() + (corner & 2 ? 0.5 : -0.5)*bbox.getHeight();
+            apply(matrix, x, y);
+            image.grow(x, y);
+        }
+
+        return image;
+    }
+};
+
+#endif // ADDRESS_PREFIXES_H
@@ -0,0 +1,171 @@
+#ifndef APPROXIMATE_IMAGE_H
+#define APPROXIMATE_IMAGE_H
+
+#include <cstdint>
+#include <vector>
+#include <math.h>
+#include "Image.h"
+#include "Splat.h"
+#include "util.h"
+
+/**
+ * Image that only keeps an approximate count and average color of each
+ * pixel, in four bytes instead of sixteen, for previews of huge images.
+ *
+ * The count is a Morris counter: an 8-bit level that goes up by one with
+ * probability BASE^-level, so that it tracks the log of the count. The color
+ * is a running mean, gamma-encoded to 8 bits per component, that's only
+ * updated when the level goes up. Those points are a fair sample of all the
+ * points, each standing in for the BASE^level points it took to get there.
+ *
+ * The random numbers come from the render thread's generator, so use one
+ * image per thread.
+ */
+class ApproximateImage {
+    // Growth of the count from one level to the next. The highest level
+    // stands for about four billion points, and counts are accurate to about
+    // 20%.
+    static constexpr double BASE = 1.08;
+    static const int LEVEL_COUNT = 256;
+
+    struct Pixel {
+        uint8_t level;
+        gamma_color red;
+        gamma_color green;
+        gamma_color blue;
+    };
+
+    // Lookup tables indexed by level or encoded color.
+    struct Tables {
+        // Expected number of points that got a counter to each level.
+        double count[LEVEL_COUNT];
+        // Probability of going up from each level.
+        double probability[LEVEL_COUNT];
+        // Weight of the new color when going up from each level.
+        double weight[LEVEL_COUNT];
+        // Linear value (0 to 1) of each encoded color.
+        double linear[256];
+
+        Tables() {
+            for (int level = 0; level < LEVEL_COUNT; level++) {
+                double power = pow(BASE, level);
+
+                count[level] = (power - 1)/(BASE - 1);
+                probability[level] = 1/power;
+            }
+            for (int level = 0; level < LEVEL_COUNT - 1; level++) {
+                weight[level] = (count[level + 1] - count[level])/count[level + 1];
+            }
+            weight[LEVEL_COUNT - 1] = 0;
+
+            for (int c = 0; c < 256; c++) {
+                double f = (c + 0.5)/256;
+                linear[c] = f*f;
+            }
+        }
+    };
+
+    int mWidth;
+    int mHeight;
+    std::vector<Pixel> mPixels;
+
+public:
+    ApproximateImage(int width, int height)
+        : mWidth(width), mHeight(height), mPixels(width*height) {
+
+        // Nothing.
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    uint64_t getByteCount() const {
+        return mPixels.size()*sizeof(Pixel);
+    }
+
+    bool isInBounds(int x, int y) const {
+        return x >= 0 && y >= 0 && x < mWidth && y < mHeight;
+    }
+
+    /**
+     * Maybe count a point of this color.
+     */
+    void touchPixel(int x, int y, linear_color red, linear_color green, linear_color blue) {
+        Tables const &tables = getTables();
+        Pixel &pixel = mPixels[y*mWidth + x];
+        int level = pixel.level;
+
+        if (level < LEVEL_COUNT - 1 && my_randd() < tables.probability[level]) {
+            double weight = tables.weight[level];
+
+            pixel.red = updateMean(pixel.red, red, weight);
+            pixel.green = updateMean(pixel.green, green, weight);
+            pixel.blue = updateMean(pixel.blue, blue, weight);
+            pixel.level = level + 1;
+        }
+    }
+
+    /**
+     * Maybe count a batch of points.
+     */
+    void touchPixels(const Splat *splats, int count) {
+        for (int i = 0; i < count; i++) {
+            const Splat &splat = splats[i];
+            touchPixel(splat.x, splat.y, splat.red, splat.green, splat.blue);
+        }
+    }
+
+    /**
+     * Add the estimated counts and sums to an image of the same size.
+     */
+    void addTo(Image &image) const {
+        Tables const &tables = getTables();
+
+        for (int y = 0; y < mHeight; y++) {
+            for (int x = 0; x < mWidth; x++) {
+                const Pixel &pixel = mPixels[y*mWidth + x];
+
+                if (pixel.level > 0) {
+                    double count = tables.count[pixel.level];
+                    double sumScale = count*65535;
+
+                    image.addPoints(x, y,
+                            (uint64_t) (tables.linear[pixel.red]*sumScale),
+                            (uint64_t) (tables.linear[pixel.green]*sumScale),
+                            (uint64_t) (tables.linear[pixel.blue]*sumScale),
+                            (uint64_t) (count + 0.5));
+                }
+            }
+        }
+    }
+
+private:
+    static Tables const &getTables() {
+        static const Tables tables;
+        return tables;
+    }
+
+    /**
+     * Move an encoded mean towards a new color by "weight". The result is
+     * rounded up or down at random so that small steps aren't lost.
+     */
+    static gamma_color updateMean(gamma_color mean, linear_color color, double weight) {
+        double linear = getTables().linear[mean];
+        linear += (color/65535.0 - linear)*weight;
+
+        double encoded = sqrt(linear)*256 - 0.5;
+        if (encoded < 0) {
+            return 0;
+        }
+
+        int rounded = (int) (encoded + my_randd());
+        return rounded > 255 ? 255 : rounded;
+    }
+};
+
+#endif // APPROXIMATE_IMAGE_H
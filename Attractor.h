@@ -1,6 +1,8 @@
 #ifndef ATTRACTOR_H
 #define ATTRACTOR_H
 
+#include <memory>
+
 // Base class of attractors that can transform 2D points to other 2D points.
 class Attractor {
     double mProbability;
@@ -14,6 +16,10 @@ public:
     // Transform a point in-place.
     virtual void transform(double &x, double &y) const = 0;
 
+    // Make a new attractor whose parameters are "t" (0 to 1) of the way from
+    // ours to "other"'s. Returns null if "other" is of a different type.
+    virtual std::unique_ptr<Attractor> interpolate(Attractor const &other, double t) const = 0;
+
     // Probability of choosing this attractor in the set it's contained in.
     void setProbability(double p) {
         mProbability = p;
@@ -31,6 +37,18 @@ public:
     double getColorMapValue() const {
         return mColorMapValue;
     }
+
+protected:
+    // Set our probability and color map value "t" of the way from "a"'s to "b"'s.
+    void interpolateCommon(Attractor const &a, Attractor const &b, double t) {
+        mProbability = lerp(a.mProbability, b.mProbability, t);
+        mColorMapValue = lerp(a.mColorMapValue, b.mColorMapValue, t);
+    }
+
+    // Linear interpolation from "a" (t = 0) to "b" (t = 1).
+    static double lerp(double a, double b, double t) {
+        return a + (b - a)*t;
+    }
 };
 
 #endif // ATTRACTOR_H
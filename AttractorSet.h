@@ -66,7 +66,21 @@ public:
      * Return a random attractor.
      */
     Attractor const &choose() const {
-        return *mAttractors[mProbabilityMap[my_randl() % PROBABILITY_MAP_SIZE]];
+        return *mAttractors[chooseIndex()];
+    }
+
+    /**
+     * Return the index of a random attractor.
+     */
+    int chooseIndex() const {
+        return mProbabilityMap[my_randl() % PROBABILITY_MAP_SIZE];
+    }
+
+    /**
+     * Return the number of attractors.
+     */
+    int getCount() const {
+        return mAttractors.size();
     }
 
     /**
@@ -79,7 +93,7 @@ public:
     /**
      * Return the specified attractor.
      */
-    Attractor const &get(int index) {
+    Attractor const &get(int index) const {
         return *mAttractors[index];
     }
 
@@ -97,6 +111,29 @@ public:
         mAttractors[index]->setColorMapValue(colorMapValue);
     }
 
+    /**
+     * Make a new set whose attractors are "t" (0 to 1) of the way from ours to
+     * "other"'s. Returns null if the two sets don't have the same number and
+     * types of attractors.
+     */
+    std::unique_ptr<AttractorSet> interpolate(AttractorSet const &other, double t) const {
+        if (other.mAttractors.size() != mAttractors.size()) {
+            return nullptr;
+        }
+
+        auto attractorSet = std::make_unique<AttractorSet>(mAttractors.size());
+        for (unsigned i = 0; i < mAttractors.size(); i++) {
+            auto attractor = mAttractors[i]->interpolate(*other.mAttractors[i], t);
+            if (!attractor) {
+                return nullptr;
+            }
+            attractorSet->set(i, std::move(attractor));
+        }
+        attractorSet->makeProbabilityMap();
+
+        return attractorSet;
+    }
+
 #if 0
     static AttractorSet *makeFlameTestAttractors(double param) {
         AttractorSet *a = new AttractorSet(4);
@@ -26,6 +26,19 @@ public:
         x = (x + mTx)/2;
         y = (y + mTy)/2;
     }
+
+    virtual std::unique_ptr<Attractor> interpolate(Attractor const &other, double t) const {
+        auto o = dynamic_cast<AverageAttractor const *>(&other);
+        if (o == nullptr) {
+            return nullptr;
+        }
+
+        auto attractor = std::make_unique<AverageAttractor>(
+                lerp(mTx, o->mTx, t), lerp(mTy, o->mTy, t));
+        attractor->interpolateCommon(*this, *o, t);
+
+        return attractor;
+    }
 };
 
 #endif // AVERAGE_ATTRACTOR_H
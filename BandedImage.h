@@ -0,0 +1,195 @@
+#ifndef BANDED_IMAGE_H
+#define BANDED_IMAGE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "Image.h"
+#include "Splat.h"
+#include "SpscRing.h"
+#include "util.h"
+
+/**
+ * Image split into one horizontal band per render thread, with each band
+ * only ever touched by the thread that owns it. A point that lands in
+ * another thread's band is sent to that thread through a lock-free queue,
+ * and the owner applies it along with the others it receives. There's a
+ * single copy of each pixel and no locks or atomic adds on pixels.
+ */
+class BandedImage {
+    // Splats per queue between each pair of threads, 16 bytes each.
+    static const int RING_CAPACITY = 1024;
+
+    int mWidth;
+    int mHeight;
+    int mThreadCount;
+    int mBandHeight;
+    std::vector<std::unique_ptr<Image>> mBands;
+    // Indexed by from*mThreadCount + to.
+    std::vector<std::unique_ptr<SpscRing<Splat>>> mRings;
+    // Number of threads that have finished rendering.
+    std::atomic<int> mFinishedCount;
+
+public:
+    /**
+     * The accumulator used by one render thread. Touches pixels in its own
+     * band and forwards the rest to their owners.
+     */
+    class Partition {
+        // How often to apply splats received from other threads.
+        static const int DRAIN_INTERVAL = 4096;
+
+        BandedImage &mImage;
+        int mOwner;
+        int mFirstRow;
+        Image &mBand;
+        int mTouchCount;
+
+    public:
+        Partition(BandedImage &image, int owner)
+            : mImage(image), mOwner(owner), mFirstRow(owner*image.mBandHeight),
+            mBand(*image.mBands[owner]), mTouchCount(0) {
+
+            // Nothing.
+        }
+
+        int getWidth() const {
+            return mImage.mWidth;
+        }
+
+        int getHeight() const {
+            return mImage.mHeight;
+        }
+
+        /**
+         * Returns whether the pixel (x, y) is within the image.
+         */
+        bool isInBounds(int x, int y) const {
+            return x >= 0 && y >= 0 && x < mImage.mWidth && y < mImage.mHeight;
+        }
+
+        /**
+         * Add some color to a pixel, or send it to the pixel's owner.
+         */
+        void touchPixel(int x, int y, linear_color red, linear_color green, linear_color blue) {
+            int owner = y/mImage.mBandHeight;
+
+            if (owner == mOwner) {
+                mBand.touchPixel(x, y - mFirstRow, red, green, blue);
+            } else {
+                Splat splat = { x, y, red, green, blue };
+                SpscRing<Splat> &ring = mImage.getRing(mOwner, owner);
+
+                // If the owner is behind, catch up on our own work so that
+                // two threads waiting on each other can't deadlock.
+                while (!ring.push(splat)) {
+                    drain();
+                    std::this_thread::yield();
+                }
+            }
+
+            mTouchCount++;
+            if (mTouchCount == DRAIN_INTERVAL) {
+                mTouchCount = 0;
+                drain();
+            }
+        }
+
+        /**
+         * Apply all splats sent to us by other threads.
+         */
+        void drain() {
+            for (int from = 0; from < mImage.mThreadCount; from++) {
+                if (from != mOwner) {
+                    mImage.getRing(from, mOwner).popAll([this](Splat const &splat) {
+                        mBand.touchPixel(splat.x, splat.y - mFirstRow,
+                                splat.red, splat.green, splat.blue);
+                    });
+                }
+            }
+        }
+
+        /**
+         * Call when done rendering. Keeps applying splats from the other
+         * threads until they're all done too.
+         */
+        void finish() {
+            mImage.mFinishedCount++;
+
+            while (mImage.mFinishedCount < mImage.mThreadCount) {
+                drain();
+                std::this_thread::yield();
+            }
+
+            // Everyone's done sending.
+            drain();
+        }
+    };
+
+    BandedImage(int width, int height, int threadCount)
+        : mWidth(width), mHeight(height), mThreadCount(threadCount),
+        mBandHeight((height + threadCount - 1)/threadCount), mFinishedCount(0) {
+
+        // Whole rows of tiles, so that no tile is split between threads.
+        mBandHeight = (mBandHeight + Image::TILE_SIZE - 1)/Image::TILE_SIZE*Image::TILE_SIZE;
+
+        for (int t = 0; t < threadCount; t++) {
+            // Last band may be short, or even empty.
+            int firstRow = t*mBandHeight;
+            int bandHeight = height - firstRow < mBandHeight ? height - firstRow : mBandHeight;
+            mBands.emplace_back(std::make_unique<Image>(width, bandHeight < 0 ? 0 : bandHeight));
+        }
+
+        for (int i = 0; i < threadCount*threadCount; i++) {
+            mRings.emplace_back(std::make_unique<SpscRing<Splat>>(RING_CAPACITY));
+        }
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    /**
+     * Approximate number of bytes used by the accumulated values and queues.
+     */
+    uint64_t getByteCount() const {
+        uint64_t byteCount = mRings.size()*RING_CAPACITY*sizeof(Splat);
+
+        for (auto const &band : mBands) {
+            byteCount += band->getByteCount();
+        }
+
+        return byteCount;
+    }
+
+    /**
+     * Read a row of pixels from its band into "values", as for
+     * Image::readRow(), so that the tone mapper can convert the bands
+     * without summing them into another image first.
+     */
+    void readRow(int y, uint64_t *values) const {
+        readRow(y, 0, mWidth, values);
+    }
+
+    /**
+     * Like readRow(), but only the "count" pixels from "left".
+     */
+    void readRow(int y, int left, int count, uint64_t *values) const {
+        int band = y/mBandHeight;
+
+        mBands[band]->readRow(y - band*mBandHeight, left, count, values);
+    }
+
+private:
+    SpscRing<Splat> &getRing(int from, int to) {
+        return *mRings[from*mThreadCount + to];
+    }
+};
+
+#endif // BANDED_IMAGE_H
@@ -45,6 +45,48 @@ public:
         }
     }
 
+    /**
+     * Grow the bounding box so as to include the other box.
+     */
+    void grow(const BoundingBox &other) {
+        other.assertInitialized();
+
+        grow(other.mMinX, other.mMinY);
+        grow(other.mMaxX, other.mMaxY);
+    }
+
+    /**
+     * The left edge of the bounding box.
+     */
+    double getMinX() const {
+        assertInitialized();
+        return mMinX;
+    }
+
+    /**
+     * The bottom edge of the bounding box.
+     */
+    double getMinY() const {
+        assertInitialized();
+        return mMinY;
+    }
+
+    /**
+     * The right edge of the bounding box.
+     */
+    double getMaxX() const {
+        assertInitialized();
+        return mMaxX;
+    }
+
+    /**
+     * The top edge of the bounding box.
+     */
+    double getMaxY() const {
+        assertInitialized();
+        return mMaxY;
+    }
+
     /**
      * The width of the bounding box.
      */
@@ -133,6 +175,61 @@ public:
         }
     }
 
+    /**
+     * Whether the two boxes overlap.
+     */
+    bool intersects(const BoundingBox &other) const {
+        assertInitialized();
+        other.assertInitialized();
+
+        return mMinX <= other.mMaxX && other.mMinX <= mMaxX &&
+            mMinY <= other.mMaxY && other.mMinY <= mMaxY;
+    }
+
+    /**
+     * Whether the other box is entirely inside this one.
+     */
+    bool contains(const BoundingBox &other) const {
+        assertInitialized();
+        other.assertInitialized();
+
+        return other.mMinX >= mMinX && other.mMaxX <= mMaxX &&
+            other.mMinY >= mMinY && other.mMaxY <= mMaxY;
+    }
+
+    /**
+     * Grow the box around its center until its height is "aspect" times its
+     * width, like makeSquare() for other shapes.
+     */
+    void growToAspect(double aspect) {
+        assertInitialized();
+
+        double width = getWidth();
+        double height = getHeight();
+
+        if (width*aspect > height) {
+            double centerY = getYCenter();
+            mMinY = centerY - width*aspect/2;
+            mMaxY = centerY + width*aspect/2;
+        } else {
+            double centerX = getXCenter();
+            mMinX = centerX - height/aspect/2;
+            mMaxX = centerX + height/aspect/2;
+        }
+    }
+
+    /**
+     * Return the part of the box between the fractions "left" and "right"
+     * horizontally and "top" and "bottom" vertically, measured from the top
+     * like the image.
+     */
+    BoundingBox crop(double left, double top, double right, double bottom) const {
+        assertInitialized();
+
+        return BoundingBox(mMinX + getWidth()*left, mMaxY - getHeight()*bottom,
+                mMinX + getWidth()*right, mMaxY - getHeight()*top);
+    }
+
     /**
      * Stream a human-friendly version of the bounding box.
      */
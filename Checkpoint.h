@@ -0,0 +1,228 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "AccumulationFile.h"
+#include "BoundingBox.h"
+#include "Image.h"
+#include "MappedFile.h"
+#include "RenderState.h"
+
+/**
+ * Snapshot of a render in progress, from which it can be continued exactly:
+ * the accumulated image and the state of each render thread's orbit. A hash
+ * of the config files and the bounding box are kept so that the render
+ * continues with the same ones. Little-endian:
+ *
+ *     "IFSCHECK"              magic
+ *     uint32 version          1
+ *     uint64 configHash
+ *     uint32 width
+ *     uint32 height
+ *     double minX, minY, maxX, maxY
+ *     uint64 iterationCount   per thread, when written
+ *     uint32 threadCount
+ *     for each thread:
+ *         uint64 iteration    next iteration
+ *         double x, y, colorMapValue
+ *         uint16 random[3]
+ *     image rows, as in AccumulationFile
+ */
+class Checkpoint {
+    static const uint32_t VERSION = 1;
+    // Bytes before the thread states, and in each one.
+    static const int HEADER_SIZE = 72;
+    static const int STATE_SIZE = 38;
+    // More than any machine has cores, but not so many that a corrupt
+    // checkpoint can start billions of threads.
+    static const uint64_t MAX_THREAD_COUNT = 65536;
+
+    uint64_t mConfigHash;
+    BoundingBox mBbox;
+    uint64_t mIterationCount;
+    std::vector<RenderState> mStates;
+    std::unique_ptr<Image> mImage;
+
+public:
+    Checkpoint(uint64_t configHash, BoundingBox const &bbox, uint64_t iterationCount,
+            std::vector<RenderState> const &states, std::unique_ptr<Image> &&image)
+        : mConfigHash(configHash), mBbox(bbox), mIterationCount(iterationCount),
+        mStates(states), mImage(std::move(image)) {
+
+        // Nothing.
+    }
+
+    uint64_t getConfigHash() const {
+        return mConfigHash;
+    }
+
+    BoundingBox const &getBbox() const {
+        return mBbox;
+    }
+
+    uint64_t getIterationCount() const {
+        return mIterationCount;
+    }
+
+    std::vector<RenderState> const &getStates() const {
+        return mStates;
+    }
+
+    /**
+     * Hand over the image.
+     */
+    std::unique_ptr<Image> takeImage() {
+        return std::move(mImage);
+    }
+
+    /**
+     * Write a checkpoint, returning whether successful. It's written to a
+     * temporary file that then replaces the pathname, so that the previous
+     * checkpoint survives being interrupted.
+     */
+    static bool write(const std::string &pathname, uint64_t configHash,
+            BoundingBox const &bbox, uint64_t iterationCount,
+            std::vector<RenderState> const &states, const Image &image) {
+
+        std::string temporaryPathname = pathname + ".tmp";
+        FILE *f = fopen(temporaryPathname.c_str(), "wb");
+        if (f == nullptr) {
+            perror(temporaryPathname.c_str());
+            return false;
+        }
+
+        std::vector<uint8_t> bytes = { 'I', 'F', 'S', 'C', 'H', 'E', 'C', 'K' };
+        appendUint(bytes, VERSION, 4);
+        appendUint(bytes, configHash, 8);
+        appendUint(bytes, image.getWidth(), 4);
+        appendUint(bytes, image.getHeight(), 4);
+        appendDouble(bytes, bbox.getMinX());
+        appendDouble(bytes, bbox.getMinY());
+        appendDouble(bytes, bbox.getMaxX());
+        appendDouble(bytes, bbox.getMaxY());
+        appendUint(bytes, iterationCount, 8);
+        appendUint(bytes, states.size(), 4);
+        for (RenderState const &state : states) {
+            appendUint(bytes, state.iteration, 8);
+            appendDouble(bytes, state.x);
+            appendDouble(bytes, state.y);
+            appendDouble(bytes, state.colorMapValue);
+            for (int i = 0; i < 3; i++) {
+                appendUint(bytes, state.random[i], 2);
+            }
+        }
+        fwrite(&bytes[0], 1, bytes.size(), f);
+        AccumulationFile::writeRows(f, image);
+
+        bool success = !ferror(f);
+        success = fclose(f) == 0 && success;
+        if (success && rename(temporaryPathname.c_str(), pathname.c_str()) == -1) {
+            perror(pathname.c_str());
+            success = false;
+        }
+
+        return success;
+    }
+
+    /**
+     * Read a checkpoint written by write(), or null on error. The file is
+     * mapped into memory and the image decoded straight from it. The sizes
+     * are checked against the file before anything is allocated for them.
+     */
+    static std::unique_ptr<Checkpoint> read(const std::string &pathname) {
+        MappedFile file;
+        if (!file.open(pathname)) {
+            return nullptr;
+        }
+
+        const uint8_t *p = file.getData();
+        const uint8_t *end = p + file.getSize();
+        std::unique_ptr<Checkpoint> checkpoint;
+        if (file.getSize() >= HEADER_SIZE && memcmp(p, "IFSCHECK", 8) == 0) {
+            p += 8;
+            uint64_t version = takeUint(p, 4);
+            uint64_t configHash = takeUint(p, 8);
+            uint64_t width = takeUint(p, 4);
+            uint64_t height = takeUint(p, 4);
+            double minX = takeDouble(p);
+            double minY = takeDouble(p);
+            double maxX = takeDouble(p);
+            double maxY = takeDouble(p);
+            uint64_t iterationCount = takeUint(p, 8);
+            uint64_t threadCount = takeUint(p, 4);
+
+            if (version == VERSION &&
+                    threadCount >= 1 && threadCount <= MAX_THREAD_COUNT &&
+                    width >= 1 && height >= 1 && Image::isSizeSupported(width, height) &&
+                    // Each row takes at least a byte, for its run count.
+                    HEADER_SIZE + threadCount*STATE_SIZE + height <= file.getSize()) {
+
+                std::vector<RenderState> states(threadCount);
+                for (RenderState &state : states) {
+                    state.iteration = takeUint(p, 8);
+                    state.x = takeDouble(p);
+                    state.y = takeDouble(p);
+                    state.colorMapValue = takeDouble(p);
+                    for (int i = 0; i < 3; i++) {
+                        state.random[i] = takeUint(p, 2);
+                    }
+                }
+
+                auto image = std::make_unique<Image>(width, height);
+                if (AccumulationFile::readRows(p, end, *image)) {
+                    checkpoint = std::make_unique<Checkpoint>(configHash,
+                            BoundingBox(minX, minY, maxX, maxY), iterationCount,
+                            states, std::move(image));
+                }
+            }
+        }
+
+        if (!checkpoint) {
+            std::cerr << "Invalid checkpoint: " << pathname << std::endl;
+        }
+        return checkpoint;
+    }
+
+private:
+    static void appendUint(std::vector<uint8_t> &v, uint64_t value, int size) {
+        for (int i = 0; i < size; i++) {
+            v.push_back(value >> i*8);
+        }
+    }
+
+    static void appendDouble(std::vector<uint8_t> &v, double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        appendUint(v, bits, 8);
+    }
+
+    /**
+     * Get the value at "p", which is moved past it. The caller checks that
+     * it's within the file.
+     */
+    static uint64_t takeUint(const uint8_t *&p, int size) {
+        uint64_t value = 0;
+
+        for (int i = 0; i < size; i++) {
+            value |= (uint64_t) *p++ << i*8;
+        }
+
+        return value;
+    }
+
+    static double takeDouble(const uint8_t *&p) {
+        uint64_t bits = takeUint(p, 8);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+
+        return value;
+    }
+};
+
+#endif // CHECKPOINT_H
@@ -4,6 +4,7 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <vector>
 #include <fstream>
 #include "ColorMap.h"
 
@@ -52,6 +53,19 @@ public:
         auto itr = mMaps.find(name);
         return itr == mMaps.end() ? nullptr : itr->second;
     }
+
+    /**
+     * Names of all color maps, in alphabetical order.
+     */
+    std::vector<std::string> getNames() const {
+        std::vector<std::string> names;
+
+        for (auto const &entry : mMaps) {
+            names.push_back(entry.first);
+        }
+
+        return names;
+    }
 };
 
 #endif // COLOR_MAPS_H
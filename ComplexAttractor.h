@@ -37,6 +37,20 @@ public:
         y = new_y;
     }
 
+    virtual std::unique_ptr<Attractor> interpolate(Attractor const &other, double t) const {
+        auto o = dynamic_cast<ComplexAttractor const *>(&other);
+        if (o == nullptr) {
+            return nullptr;
+        }
+
+        auto attractor = std::make_unique<ComplexAttractor>(
+                lerp(mSr, o->mSr, t), lerp(mSi, o->mSi, t),
+                lerp(mAr, o->mAr, t), lerp(mAi, o->mAi, t));
+        attractor->interpolateCommon(*this, *o, t);
+
+        return attractor;
+    }
+
 private:
     /**
      * Real part of complex product.
@@ -45,6 +45,24 @@ public:
         return *mColorMap;
     }
 
+    /**
+     * Make a new config whose attractors and variations are "t" (0 to 1) of
+     * the way from ours to "other"'s. The color map and file time are ours.
+     * Returns null (and prints an error) if the two configs don't have the same
+     * number and types of attractors.
+     */
+    std::unique_ptr<Config> interpolate(Config const &other, double t) const {
+        auto attractorSet = mAttractorSet->interpolate(*other.mAttractorSet, t);
+        if (!attractorSet) {
+            std::cerr << "Configs must have the same number and types of attractors"
+                << std::endl;
+            return nullptr;
+        }
+
+        return std::make_unique<Config>(mFileTime, std::move(attractorSet),
+                mVariations->interpolate(*other.mVariations, t), mColorMap);
+    }
+
     /**
      * Return the modification time of the file, in nanoseconds since
      * the epoch, or 0 if the file can't be opened (and an error is
@@ -61,6 +79,28 @@ public:
             statbuf.st_mtimespec.tv_nsec;
     }
 
+    /**
+     * Continue the 64-bit FNV-1a hash "hash" with the contents of the file,
+     * to tell whether a config has changed. Returns 0 if the file can't be
+     * opened (and an error is printed).
+     */
+    static uint64_t getFileHash(std::string const &pathname,
+            uint64_t hash = 0xCBF29CE484222325ULL) {
+
+        std::ifstream f(pathname, std::ios::binary);
+        if (!f) {
+            std::cerr << "Config file not found: " << pathname << std::endl;
+            return 0;
+        }
+
+        char c;
+        while (f.get(c)) {
+            hash = (hash ^ (uint8_t) c)*0x100000001B3ULL;
+        }
+
+        return hash;
+    }
+
     /**
      * Load the config file, or null on error.
      */
@@ -0,0 +1,229 @@
+#ifndef DEEP_ZOOM_WRITER_H
+#define DEEP_ZOOM_WRITER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "Image.h"
+#include "MipPyramid.h"
+#include "PngWriter.h"
+#include "ToneMapper.h"
+#include "util.h"
+
+/**
+ * Saves an accumulated image as a Deep Zoom (DZI) tile pyramid for pan and
+ * zoom web viewers such as OpenSeadragon: "name.dzi" describes the image
+ * and "name_files/<level>/<column>_<row>.png" hold its 256-pixel tiles,
+ * level 0 being a single pixel and the last level full size. Each level is
+ * summed down from the counts before brightening, like MipPyramid, and
+ * every tile is tone mapped and encoded straight from the counts, one tile
+ * per task, so no full-size 8-bit image is ever made.
+ *
+ * A hash of each tile's pixels is kept in "name_files/tiles.txt". Saving
+ * the pyramid again still tone maps every tile, but doesn't write the ones
+ * whose 8-bit pixels haven't changed. That only saves the file writes, and
+ * few tiles stay the same once an extended render moves the brightest pixel.
+ */
+class DeepZoomWriter {
+    static const int TILE_SIZE = 256;
+
+    ToneMapper const &mToneMapper;
+    int mThreadCount;
+
+    // A tile to write.
+    struct Tile {
+        const Image *image;
+        double max;
+        int left;
+        int top;
+        int width;
+        int height;
+        // Relative to the "_files" directory.
+        std::string pathname;
+    };
+
+public:
+    DeepZoomWriter(ToneMapper const &toneMapper, int threadCount)
+        : mToneMapper(toneMapper), mThreadCount(threadCount) {
+
+        // Nothing.
+    }
+
+    /**
+     * Save the image, which must not have been brightened, as "name.dzi"
+     * and "name_files". "max" is the image's largest brightened component,
+     * or 0 to find it. Returns whether successful.
+     */
+    bool save(const Image &image, const std::string &name, double max = 0) const {
+        int width = image.getWidth();
+        int height = image.getHeight();
+        std::string directory = name + "_files";
+
+        // The last level is full size, each level before it half the size.
+        int lastLevel = 0;
+        while ((1 << lastLevel) < std::max(width, height)) {
+            lastLevel++;
+        }
+        MipPyramid pyramid(image, lastLevel, mThreadCount);
+
+        if (!writeDescriptor(name + ".dzi", width, height) || !makeDirectory(directory)) {
+            return false;
+        }
+
+        std::vector<Tile> tiles;
+        for (int level = lastLevel; level >= 0; level--) {
+            const Image &levelImage = level == lastLevel
+                ? image : pyramid.getLevel(lastLevel - level);
+            double levelMax = level == lastLevel && max != 0
+                ? max : mToneMapper.getMax(levelImage, mThreadCount);
+
+            std::string levelDirectory = std::to_string(level);
+            if (!makeDirectory(directory + "/" + levelDirectory)) {
+                return false;
+            }
+
+            for (int top = 0; top < levelImage.getHeight(); top += TILE_SIZE) {
+                for (int left = 0; left < levelImage.getWidth(); left += TILE_SIZE) {
+                    tiles.push_back(Tile{ &levelImage, levelMax, left, top,
+                            std::min(TILE_SIZE, levelImage.getWidth() - left),
+                            std::min(TILE_SIZE, levelImage.getHeight() - top),
+                            levelDirectory + "/" + std::to_string(left/TILE_SIZE) + "_" +
+                                std::to_string(top/TILE_SIZE) + ".png" });
+                }
+            }
+        }
+
+        // Hashes of the tiles as last written.
+        std::string hashPathname = directory + "/tiles.txt";
+        std::unordered_map<std::string, uint64_t> oldHashes = readHashes(hashPathname);
+
+        // Threads take the next tile until they run out.
+        std::vector<uint64_t> hashes(tiles.size());
+        std::atomic<int> nextTile(0);
+        std::atomic<int> writtenCount(0);
+        std::atomic<bool> success(true);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < mThreadCount; t++) {
+            threads.emplace_back([&]() {
+                std::vector<gamma_color> rgb;
+
+                for (int i = nextTile++; i < (int) tiles.size() && success; i = nextTile++) {
+                    Tile const &tile = tiles[i];
+                    std::string pathname = directory + "/" + tile.pathname;
+                    mToneMapper.toRgb(*tile.image, tile.left, tile.top, tile.width, tile.height,
+                            tile.max, rgb);
+                    hashes[i] = hash(rgb);
+
+                    auto old = oldHashes.find(tile.pathname);
+                    if (old != oldHashes.end() && old->second == hashes[i] &&
+                            fileExists(pathname)) {
+
+                        continue;
+                    }
+
+                    PngWriter writer;
+                    if (!writer.open(pathname, tile.width, tile.height) ||
+                            !writer.writeRows(&rgb[0], tile.height) || !writer.close()) {
+
+                        success = false;
+                    }
+                    writtenCount++;
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        std::cout << "Wrote " << writtenCount << " of " << tiles.size() << " tiles." << std::endl;
+
+        return success && writeHashes(hashPathname, tiles, hashes);
+    }
+
+private:
+    static bool writeDescriptor(const std::string &pathname, int width, int height) {
+        std::ofstream f(pathname);
+        f << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+            << "Format=\"png\" Overlap=\"0\" TileSize=\"" << TILE_SIZE << "\">\n"
+            << "  <Size Width=\"" << width << "\" Height=\"" << height << "\"/>\n"
+            << "</Image>\n";
+        f.close();
+
+        if (!f) {
+            std::cerr << "Cannot write " << pathname << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Read the hashes written by writeHashes(), keyed by tile pathname, or
+     * none if there's no file.
+     */
+    static std::unordered_map<std::string, uint64_t> readHashes(const std::string &pathname) {
+        std::unordered_map<std::string, uint64_t> hashes;
+        std::ifstream f(pathname);
+        std::string tilePathname;
+        uint64_t tileHash;
+
+        while (f >> tilePathname >> std::hex >> tileHash) {
+            hashes[tilePathname] = tileHash;
+        }
+
+        return hashes;
+    }
+
+    static bool writeHashes(const std::string &pathname, std::vector<Tile> const &tiles,
+            std::vector<uint64_t> const &hashes) {
+
+        std::ofstream f(pathname);
+        for (unsigned i = 0; i < tiles.size(); i++) {
+            f << tiles[i].pathname << " " << std::hex << hashes[i] << "\n";
+        }
+        f.close();
+
+        if (!f) {
+            std::cerr << "Cannot write " << pathname << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * 64-bit FNV-1a hash of the pixels.
+     */
+    static uint64_t hash(std::vector<gamma_color> const &rgb) {
+        uint64_t h = 0xCBF29CE484222325ULL;
+
+        for (gamma_color value : rgb) {
+            h = (h ^ value)*0x100000001B3ULL;
+        }
+
+        return h;
+    }
+
+    static bool makeDirectory(const std::string &pathname) {
+        if (mkdir(pathname.c_str(), 0755) == -1 && errno != EEXIST) {
+            perror(pathname.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool fileExists(const std::string &pathname) {
+        struct stat statbuf;
+        return stat(pathname.c_str(), &statbuf) == 0;
+    }
+};
+
+#endif // DEEP_ZOOM_WRITER_H
@@ -0,0 +1,234 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * Minimal deflate (RFC 1951) compressor that appends to a byte vector. Data
+ * is compressed in blocks with the fixed Huffman codes and LZ77 matches that
+ * never reach back before the start of the block, so blocks compressed
+ * separately can be joined into one stream if each ends with syncFlush().
+ */
+class Deflate {
+    static const int MIN_MATCH = 3;
+    static const int MAX_MATCH = 258;
+    static const int WINDOW_SIZE = 32768;
+    static const int HASH_BITS = 15;
+    // Positions to try for each match by default.
+    static const int MAX_CHAIN = 32;
+
+    std::vector<uint8_t> &mOut;
+    // Positions to try for each match. More is slower and compresses better.
+    int mMaxChain;
+    uint64_t mBits;
+    int mBitCount;
+
+public:
+    Deflate(std::vector<uint8_t> &out, int maxChain = MAX_CHAIN)
+        : mOut(out), mMaxChain(maxChain), mBits(0), mBitCount(0) {
+
+        // Nothing.
+    }
+
+    /**
+     * Compress the data as one non-final block.
+     */
+    void compressBlock(const uint8_t *data, int size) {
+        // Not final, fixed Huffman codes.
+        writeBits(0, 1);
+        writeBits(1, 2);
+
+        // Most recent position of each hash, and the previous position with
+        // the same hash as each position in the window.
+        std::vector<int> head(1 << HASH_BITS, -1);
+        std::vector<int> prev(WINDOW_SIZE);
+
+        int i = 0;
+        while (i < size) {
+            int bestLength = 0;
+            int bestDistance = 0;
+
+            if (i + MIN_MATCH <= size) {
+                int hash = getHash(data + i);
+                int maxLength = size - i < MAX_MATCH ? size - i : MAX_MATCH;
+
+                int candidate = head[hash];
+                for (int chain = 0; candidate >= 0 && i - candidate <= WINDOW_SIZE &&
+                        chain < mMaxChain; chain++) {
+
+                    int length = getMatchLength(data + candidate, data + i, maxLength);
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = i - candidate;
+                        if (length == maxLength) {
+                            break;
+                        }
+                    }
+                    candidate = prev[candidate % WINDOW_SIZE];
+                }
+            }
+
+            if (bestLength >= MIN_MATCH) {
+                writeLength(bestLength);
+                writeDistance(bestDistance);
+            } else {
+                writeLiteral(data[i]);
+                bestLength = 1;
+            }
+
+            // Hash every position we skip over.
+            for (int end = i + bestLength; i < end; i++) {
+                if (i + MIN_MATCH <= size) {
+                    int hash = getHash(data + i);
+                    prev[i % WINDOW_SIZE] = head[hash];
+                    head[hash] = i;
+                }
+            }
+        }
+
+        // End of block.
+        writeLiteral(256);
+    }
+
+    /**
+     * Store the data uncompressed as non-final blocks.
+     */
+    void storeBlock(const uint8_t *data, int size) {
+        do {
+            int length = size < 65535 ? size : 65535;
+
+            // Not final, stored.
+            writeBits(0, 3);
+            alignToByte();
+            writeBits(length, 16);
+            writeBits(~length & 0xFFFF, 16);
+            alignToByte();
+            mOut.insert(mOut.end(), data, data + length);
+
+            data += length;
+            size -= length;
+        } while (size > 0);
+    }
+
+    /**
+     * Write an empty stored block so that the output ends on a byte
+     * boundary.
+     */
+    void syncFlush() {
+        writeBits(0, 3);
+        alignToByte();
+        writeBits(0x0000, 16);
+        writeBits(0xFFFF, 16);
+    }
+
+    /**
+     * Write the empty final block.
+     */
+    void finish() {
+        // Final, fixed Huffman codes, end of block.
+        writeBits(1, 1);
+        writeBits(1, 2);
+        writeLiteral(256);
+        alignToByte();
+    }
+
+private:
+    static int getHash(const uint8_t *p) {
+        uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+        return (v*2654435761u) >> (32 - HASH_BITS);
+    }
+
+    static int getMatchLength(const uint8_t *a, const uint8_t *b, int maxLength) {
+        int length = 0;
+        while (length < maxLength && a[length] == b[length]) {
+            length++;
+        }
+        return length;
+    }
+
+    void writeBits(uint32_t value, int count) {
+        mBits |= (uint64_t) value << mBitCount;
+        mBitCount += count;
+
+        while (mBitCount >= 8) {
+            mOut.push_back(mBits & 0xFF);
+            mBits >>= 8;
+            mBitCount -= 8;
+        }
+    }
+
+    void alignToByte() {
+        if (mBitCount > 0) {
+            writeBits(0, 8 - mBitCount);
+        }
+    }
+
+    /**
+     * Write a Huffman code, which are stored most significant bit first.
+     */
+    void writeCode(uint32_t code, int length) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        writeBits(reversed, length);
+    }
+
+    /**
+     * Write a literal/length symbol with the fixed codes.
+     */
+    void writeLiteral(int symbol) {
+        if (symbol < 144) {
+            writeCode(0x30 + symbol, 8);
+        } else if (symbol < 256) {
+            writeCode(0x190 + symbol - 144, 9);
+        } else if (symbol < 280) {
+            writeCode(symbol - 256, 7);
+        } else {
+            writeCode(0xC0 + symbol - 280, 8);
+        }
+    }
+
+    void writeLength(int length) {
+        static const int BASE[] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+        };
+        static const int EXTRA[] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+        };
+
+        int code = 28;
+        while (BASE[code] > length) {
+            code--;
+        }
+
+        writeLiteral(257 + code);
+        writeBits(length - BASE[code], EXTRA[code]);
+    }
+
+    void writeDistance(int distance) {
+        static const int BASE[] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+            8193, 12289, 16385, 24577
+        };
+        static const int EXTRA[] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+        };
+
+        int code = 29;
+        while (BASE[code] > distance) {
+            code--;
+        }
+
+        writeCode(code, 5);
+        writeBits(distance - BASE[code], EXTRA[code]);
+    }
+};
+
+#endif // DEFLATE_H
@@ -0,0 +1,216 @@
+#ifndef DENSITY_ESTIMATOR_H
+#define DENSITY_ESTIMATOR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include "Image.h"
+#include "ToneMapper.h"
+#include "util.h"
+
+/**
+ * Smooths the sparse parts of an accumulated image before brightening, so
+ * that they look like a soft glow rather than grainy dust. Each pixel's
+ * points are spread over a blur whose radius shrinks as the pixel's count
+ * grows, so dense parts keep their detail. The blurs for a range of radii
+ * are computed up front. The output is made a strip at a time, with each
+ * band of rows spread in parallel from the source rows within reach of it.
+ */
+class DensityEstimator {
+    // Radius is "maxRadius"/count^CURVE.
+    static constexpr double CURVE = 0.4;
+    // Blurs are made for radii in steps of this many pixels.
+    static constexpr double RADIUS_STEP = 0.25;
+
+    // Weights of a square blur, normalized to add up to 1.
+    struct Kernel {
+        int halfSize;
+        std::vector<float> weights;
+    };
+
+    const Image &mImage;
+    int mWidth;
+    int mHeight;
+    int mMaxHalfSize;
+    std::vector<Kernel> mKernels;
+    // Kernel of each count. Pixels with counts past the end aren't spread.
+    std::vector<int> mCountKernels;
+
+public:
+    /**
+     * Estimate the image, which must not have been brightened, spreading
+     * pixels with a count of 1 over "maxRadius" pixels.
+     */
+    DensityEstimator(const Image &image, double maxRadius)
+        : mImage(image), mWidth(image.getWidth()), mHeight(image.getHeight()),
+        mMaxHalfSize((int) ceil(maxRadius)) {
+
+        // Radii under 1 would only keep the center pixel.
+        for (double radius = 1; radius <= maxRadius; radius += RADIUS_STEP) {
+            mKernels.push_back(makeKernel(radius));
+        }
+
+        for (int count = 0; ; count++) {
+            double radius = count == 0 ? maxRadius : maxRadius/pow(count, CURVE);
+            if (radius < 1) {
+                break;
+            }
+            int kernel = (int) ((radius - 1)/RADIUS_STEP + 0.5);
+            mCountKernels.push_back(std::min(kernel, (int) mKernels.size() - 1));
+        }
+    }
+
+    /**
+     * Spread and brighten the image with "threadCount" threads, convert it
+     * with the tone mapper and save it to the pathname as a PNG file a strip
+     * at a time, returning whether successful.
+     */
+    bool save(const std::string &pathname, ToneMapper const &toneMapper,
+            int threadCount) const {
+
+        return toneMapper.saveLinear(mWidth, mHeight,
+                [this, threadCount](int firstRow, int rowCount, float *rgb) {
+                    return makeRows(firstRow, rowCount, rgb, threadCount);
+                }, pathname, threadCount);
+    }
+
+private:
+    /**
+     * A Gaussian-like blur that falls to about an eighth at "radius".
+     */
+    static Kernel makeKernel(double radius) {
+        Kernel kernel;
+        kernel.halfSize = (int) ceil(radius);
+
+        double sum = 0;
+        for (int dy = -kernel.halfSize; dy <= kernel.halfSize; dy++) {
+            for (int dx = -kernel.halfSize; dx <= kernel.halfSize; dx++) {
+                double d2 = (dx*dx + dy*dy)/(radius*radius);
+                double weight = d2 <= 1 ? exp(-2*d2) : 0;
+                kernel.weights.push_back(weight);
+                sum += weight;
+            }
+        }
+        for (float &weight : kernel.weights) {
+            weight /= sum;
+        }
+
+        return kernel;
+    }
+
+    /**
+     * Spread and brighten "rowCount" rows starting at "firstRow" into "rgb",
+     * as linear RGB, in parallel bands of rows. Returns their largest
+     * component.
+     */
+    float makeRows(int firstRow, int rowCount, float *rgb, int threadCount) const {
+        int bandHeight = (rowCount + threadCount - 1)/threadCount;
+        std::vector<float> maxes(threadCount);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount && t*bandHeight < rowCount; t++) {
+            int bandRow = t*bandHeight;
+
+            threads.emplace_back(&DensityEstimator::spreadRows, this, firstRow + bandRow,
+                    std::min(bandHeight, rowCount - bandRow),
+                    rgb + (uint64_t) bandRow*mWidth*3, std::ref(maxes[t]));
+        }
+
+        float max = 0;
+        for (unsigned t = 0; t < threads.size(); t++) {
+            threads[t].join();
+            max = std::max(max, maxes[t]);
+        }
+
+        return max;
+    }
+
+    /**
+     * Spread the pixels within mMaxHalfSize rows of the "rowCount" rows
+     * starting at "firstRow" into just those rows, brighten them into "rgb"
+     * as linear RGB, and set "max" to their largest component.
+     */
+    void spreadRows(int firstRow, int rowCount, float *rgb, float &max) const {
+        int margin = mMaxHalfSize;
+        int firstSourceRow = std::max(firstRow - margin, 0);
+        int endSourceRow = std::min(firstRow + rowCount + margin, mHeight);
+
+        // Red, green, blue and count.
+        std::vector<float> spread((uint64_t) rowCount*mWidth*4);
+        std::vector<uint64_t> row((uint64_t) mWidth*4);
+        for (int sourceY = firstSourceRow; sourceY < endSourceRow; sourceY++) {
+            mImage.readRow(sourceY, &row[0]);
+            int y = sourceY - firstRow;
+
+            for (int x = 0; x < mWidth; x++) {
+                const uint64_t *pixel = &row[x*4];
+                uint64_t count = pixel[3];
+                if (count == 0) {
+                    continue;
+                }
+
+                float value[4] = {
+                    (float) pixel[0], (float) pixel[1], (float) pixel[2], (float) count
+                };
+
+                if (count >= mCountKernels.size()) {
+                    if (y >= 0 && y < rowCount) {
+                        float *center = &spread[((uint64_t) y*mWidth + x)*4];
+                        for (int c = 0; c < 4; c++) {
+                            center[c] += value[c];
+                        }
+                    }
+                    continue;
+                }
+
+                Kernel const &kernel = mKernels[mCountKernels[count]];
+                int halfSize = kernel.halfSize;
+                int size = halfSize*2 + 1;
+                int left = std::max(-halfSize, -x);
+                int right = std::min(halfSize, mWidth - 1 - x);
+                int top = std::max(-halfSize, -y);
+                int bottom = std::min(halfSize, rowCount - 1 - y);
+
+                for (int dy = top; dy <= bottom; dy++) {
+                    const float *weights = &kernel.weights[(dy + halfSize)*size + halfSize];
+                    float *outRow = &spread[((uint64_t) (y + dy)*mWidth + x)*4];
+
+                    // Four channels in a row, which the compiler vectorizes.
+                    for (int dx = left; dx <= right; dx++) {
+                        float weight = weights[dx];
+                        for (int c = 0; c < 4; c++) {
+                            outRow[dx*4 + c] += weight*value[c];
+                        }
+                    }
+                }
+            }
+        }
+
+        max = 0;
+        for (uint64_t i = 0; i < (uint64_t) rowCount*mWidth; i++) {
+            const float *sum = &spread[i*4];
+            float count = sum[3];
+            float *pixel = &rgb[i*3];
+
+            if (count > 0) {
+                float mult = log(1 + count)/count;
+
+                for (int c = 0; c < 3; c++) {
+                    pixel[c] = sum[c]*mult;
+                    if (pixel[c] > max) {
+                        max = pixel[c];
+                    }
+                }
+            } else {
+                pixel[0] = 0;
+                pixel[1] = 0;
+                pixel[2] = 0;
+            }
+        }
+    }
+};
+
+#endif // DENSITY_ESTIMATOR_H
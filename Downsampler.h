@@ -0,0 +1,238 @@
+#ifndef DOWNSAMPLER_H
+#define DOWNSAMPLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include "Image.h"
+#include "ToneMapper.h"
+#include "util.h"
+
+/**
+ * Shrinks an image accumulated at several times the output size, filtering
+ * the counts and sums before brightening, so that the output is like a
+ * render at its own size whose points weren't rounded to the nearest pixel.
+ * The filter is separable and applied in parallel bands of output rows, a
+ * strip at a time, so that only a strip of the output is kept in memory.
+ */
+class Downsampler {
+public:
+    enum class Filter {
+        // Sum of each block of pixels.
+        BOX,
+        // Linear falloff over two output pixels.
+        TENT,
+        // Windowed sinc over six output pixels, sharpest but may ring.
+        LANCZOS,
+    };
+
+private:
+    // Source pixels and their weights for one output row or column.
+    struct Taps {
+        int first;
+        std::vector<float> weights;
+    };
+
+    const Image &mImage;
+    int mWidth;
+    int mHeight;
+    std::vector<Taps> mColumnTaps;
+    std::vector<Taps> mRowTaps;
+
+public:
+    /**
+     * Shrink the image, which must not have been brightened, by "factor",
+     * which must divide its width and height.
+     */
+    Downsampler(const Image &image, int factor, Filter filter)
+        : mImage(image),
+        mWidth(image.getWidth()/factor), mHeight(image.getHeight()/factor),
+        mColumnTaps(makeTaps(mWidth, factor, filter)),
+        mRowTaps(makeTaps(mHeight, factor, filter)) {
+
+        // Nothing.
+    }
+
+    /**
+     * Filter and brighten the image with "threadCount" threads, convert it
+     * with the tone mapper and save it to the pathname as a PNG file a strip
+     * at a time, returning whether successful.
+     */
+    bool save(const std::string &pathname, ToneMapper const &toneMapper,
+            int threadCount) const {
+
+        return toneMapper.saveLinear(mWidth, mHeight,
+                [this, threadCount](int firstRow, int rowCount, float *rgb) {
+                    return makeRows(firstRow, rowCount, rgb, threadCount);
+                }, pathname, threadCount);
+    }
+
+private:
+    /**
+     * The source pixels for each of "outputSize" output pixels. The weights
+     * of each add up to "factor", so that the counts of a row or column of
+     * output pixels add up to those of the source.
+     */
+    static std::vector<Taps> makeTaps(int outputSize, int factor, Filter filter) {
+        double radius = filter == Filter::BOX ? 0.5 : filter == Filter::TENT ? 1 : 3;
+        int sourceSize = outputSize*factor;
+        std::vector<Taps> allTaps(outputSize);
+
+        for (int i = 0; i < outputSize; i++) {
+            double center = (i + 0.5)*factor;
+            int first = (int) floor(center - radius*factor);
+            int last = (int) ceil(center + radius*factor);
+            if (first < 0) {
+                first = 0;
+            }
+            if (last > sourceSize - 1) {
+                last = sourceSize - 1;
+            }
+
+            Taps &taps = allTaps[i];
+            taps.first = first;
+            double sum = 0;
+            for (int j = first; j <= last; j++) {
+                double weight = getWeight(filter, (j + 0.5 - center)/factor);
+                taps.weights.push_back(weight);
+                sum += weight;
+            }
+            for (float &weight : taps.weights) {
+                weight *= factor/sum;
+            }
+        }
+
+        return allTaps;
+    }
+
+    /**
+     * The filter at "x" output pixels from the center.
+     */
+    static double getWeight(Filter filter, double x) {
+        x = fabs(x);
+
+        switch (filter) {
+            case Filter::BOX:
+                return x < 0.5 ? 1 : 0;
+
+            case Filter::TENT:
+                return x < 1 ? 1 - x : 0;
+
+            case Filter::LANCZOS:
+            default:
+                return x == 0 ? 1 : x < 3 ? sinc(x)*sinc(x/3) : 0;
+        }
+    }
+
+    static double sinc(double x) {
+        return sin(M_PI*x)/(M_PI*x);
+    }
+
+    /**
+     * Filter and brighten "rowCount" output rows starting at "firstRow" into
+     * "rgb", as linear RGB, in parallel bands of rows. Returns their largest
+     * component.
+     */
+    float makeRows(int firstRow, int rowCount, float *rgb, int threadCount) const {
+        int bandHeight = (rowCount + threadCount - 1)/threadCount;
+        std::vector<float> maxes(threadCount);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount && t*bandHeight < rowCount; t++) {
+            int bandRow = t*bandHeight;
+
+            threads.emplace_back(&Downsampler::filterRows, this, firstRow + bandRow,
+                    std::min(bandHeight, rowCount - bandRow),
+                    rgb + (uint64_t) bandRow*mWidth*3, std::ref(maxes[t]));
+        }
+
+        float max = 0;
+        for (unsigned t = 0; t < threads.size(); t++) {
+            threads[t].join();
+            max = std::max(max, maxes[t]);
+        }
+
+        return max;
+    }
+
+    /**
+     * Filter and brighten "rowCount" output rows starting at "firstRow" into
+     * "out", as linear RGB, and set "max" to their largest component.
+     */
+    void filterRows(int firstRow, int rowCount, float *out, float &max) const {
+        Taps const &firstTaps = mRowTaps[firstRow];
+        Taps const &lastTaps = mRowTaps[firstRow + rowCount - 1];
+        int firstSourceRow = firstTaps.first;
+        int sourceRowCount = lastTaps.first + lastTaps.weights.size() - firstSourceRow;
+
+        // Filter the source rows horizontally, as red, green, blue and count.
+        int sourceWidth = mImage.getWidth();
+        std::vector<uint64_t> sourceRow((uint64_t) sourceWidth*4);
+        std::vector<float> filtered((uint64_t) sourceRowCount*mWidth*4);
+        for (int y = 0; y < sourceRowCount; y++) {
+            mImage.readRow(firstSourceRow + y, &sourceRow[0]);
+
+            float *filteredRow = &filtered[(uint64_t) y*mWidth*4];
+            for (int x = 0; x < mWidth; x++) {
+                Taps const &taps = mColumnTaps[x];
+                const uint64_t *source = &sourceRow[taps.first*4];
+                float sum[4] = { 0, 0, 0, 0 };
+
+                for (unsigned i = 0; i < taps.weights.size(); i++) {
+                    float weight = taps.weights[i];
+                    for (int c = 0; c < 4; c++) {
+                        sum[c] += weight*source[i*4 + c];
+                    }
+                }
+                for (int c = 0; c < 4; c++) {
+                    filteredRow[x*4 + c] = sum[c];
+                }
+            }
+        }
+
+        // Then vertically, and brighten.
+        max = 0;
+        std::vector<float> sum((uint64_t) mWidth*4);
+        for (int y = 0; y < rowCount; y++) {
+            Taps const &taps = mRowTaps[firstRow + y];
+            std::fill(sum.begin(), sum.end(), 0);
+
+            for (unsigned i = 0; i < taps.weights.size(); i++) {
+                float weight = taps.weights[i];
+                const float *filteredRow =
+                    &filtered[(uint64_t) (taps.first - firstSourceRow + i)*mWidth*4];
+
+                for (int x = 0; x < mWidth*4; x++) {
+                    sum[x] += weight*filteredRow[x];
+                }
+            }
+
+            for (int x = 0; x < mWidth; x++) {
+                float count = sum[x*4 + 3];
+                float *pixel = &out[((uint64_t) y*mWidth + x)*3];
+
+                // Negative lobes can make small negative values.
+                if (count > 0) {
+                    float mult = log(1 + count)/count;
+
+                    for (int c = 0; c < 3; c++) {
+                        float value = sum[x*4 + c] > 0 ? sum[x*4 + c]*mult : 0;
+                        pixel[c] = value;
+                        if (value > max) {
+                            max = value;
+                        }
+                    }
+                } else {
+                    pixel[0] = 0;
+                    pixel[1] = 0;
+                    pixel[2] = 0;
+                }
+            }
+        }
+    }
+};
+
+#endif // DOWNSAMPLER_H
@@ -0,0 +1,217 @@
+#ifndef HDR_WRITER_H
+#define HDR_WRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Writes linear floating-point RGB images for tone mapping and grading in
+ * other tools, as PFM or as minimal single-part scanline OpenEXR files with
+ * 32-bit float channels, either uncompressed or RLE compressed. The pixels
+ * are row by row from the top, three floats each.
+ */
+class HdrWriter {
+public:
+    /**
+     * Save a Portable Float Map, returning whether successful.
+     */
+    static bool savePfm(const std::string &pathname, int width, int height,
+            std::vector<float> const &rgb) {
+
+        FILE *f = fopen(pathname.c_str(), "wb");
+        if (f == nullptr) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        // Negative scale means little-endian. Rows go from the bottom.
+        fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+        for (int y = height - 1; y >= 0; y--) {
+            std::vector<uint8_t> row;
+            for (int i = 0; i < width*3; i++) {
+                appendFloat(row, rgb[(uint64_t) y*width*3 + i]);
+            }
+            fwrite(&row[0], 1, row.size(), f);
+        }
+
+        bool success = !ferror(f);
+        return fclose(f) == 0 && success;
+    }
+
+    /**
+     * Save an OpenEXR file, returning whether successful.
+     */
+    static bool saveExr(const std::string &pathname, int width, int height,
+            std::vector<float> const &rgb, bool rle) {
+
+        FILE *f = fopen(pathname.c_str(), "wb");
+        if (f == nullptr) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        // Magic number, then version 2 with no flags (single-part scanline).
+        std::vector<uint8_t> header = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+
+        // Channels in alphabetical order.
+        std::vector<uint8_t> channels;
+        for (const char *name : { "B", "G", "R" }) {
+            appendString(channels, name);
+            appendInt32(channels, 2);       // Float.
+            appendInt32(channels, 0);       // Not perceptually linear, reserved.
+            appendInt32(channels, 1);       // X sampling.
+            appendInt32(channels, 1);       // Y sampling.
+        }
+        channels.push_back(0);
+        appendAttribute(header, "channels", "chlist", channels);
+
+        appendAttribute(header, "compression", "compression",
+                std::vector<uint8_t>{ (uint8_t) (rle ? 1 : 0) });
+
+        std::vector<uint8_t> window;
+        appendInt32(window, 0);
+        appendInt32(window, 0);
+        appendInt32(window, width - 1);
+        appendInt32(window, height - 1);
+        appendAttribute(header, "dataWindow", "box2i", window);
+        appendAttribute(header, "displayWindow", "box2i", window);
+
+        appendAttribute(header, "lineOrder", "lineOrder", std::vector<uint8_t>{ 0 });
+
+        std::vector<uint8_t> one;
+        appendFloat(one, 1);
+        appendAttribute(header, "pixelAspectRatio", "float", one);
+
+        std::vector<uint8_t> center;
+        appendFloat(center, 0);
+        appendFloat(center, 0);
+        appendAttribute(header, "screenWindowCenter", "v2f", center);
+        appendAttribute(header, "screenWindowWidth", "float", one);
+        header.push_back(0);
+
+        // One scanline per chunk, each located by the offset table.
+        std::vector<std::vector<uint8_t>> chunks(height);
+        for (int y = 0; y < height; y++) {
+            std::vector<uint8_t> line;
+            for (int c = 2; c >= 0; c--) {
+                for (int x = 0; x < width; x++) {
+                    appendFloat(line, rgb[((uint64_t) y*width + x)*3 + c]);
+                }
+            }
+
+            std::vector<uint8_t> &chunk = chunks[y];
+            appendInt32(chunk, y);
+            std::vector<uint8_t> data = rle ? compressRle(line) : line;
+            if (data.size() >= line.size()) {
+                // Readers take a chunk of full size as uncompressed.
+                data = line;
+            }
+            appendInt32(chunk, data.size());
+            chunk.insert(chunk.end(), data.begin(), data.end());
+        }
+
+        std::vector<uint8_t> offsets;
+        uint64_t offset = header.size() + (uint64_t) height*8;
+        for (auto const &chunk : chunks) {
+            appendUint64(offsets, offset);
+            offset += chunk.size();
+        }
+
+        fwrite(&header[0], 1, header.size(), f);
+        fwrite(&offsets[0], 1, offsets.size(), f);
+        for (auto const &chunk : chunks) {
+            fwrite(&chunk[0], 1, chunk.size(), f);
+        }
+
+        bool success = !ferror(f);
+        return fclose(f) == 0 && success;
+    }
+
+private:
+    /**
+     * OpenEXR's RLE compression: the bytes are split into even and odd
+     * halves, delta encoded, and run-length encoded.
+     */
+    static std::vector<uint8_t> compressRle(std::vector<uint8_t> const &data) {
+        const int MIN_RUN = 3;
+        const int MAX_RUN = 127;
+        int size = data.size();
+
+        std::vector<uint8_t> split(size);
+        for (int i = 0; i < size; i++) {
+            split[i % 2 == 0 ? i/2 : (size + 1)/2 + i/2] = data[i];
+        }
+        for (int i = size - 1; i > 0; i--) {
+            split[i] = split[i] - split[i - 1] + 128;
+        }
+
+        std::vector<uint8_t> out;
+        int start = 0;
+        while (start < size) {
+            int end = start + 1;
+            while (end < size && split[end] == split[start] && end - start - 1 < MAX_RUN) {
+                end++;
+            }
+
+            if (end - start >= MIN_RUN) {
+                // A run of one repeated byte.
+                out.push_back(end - start - 1);
+                out.push_back(split[start]);
+            } else {
+                // Literal bytes until the next run of three.
+                end = start;
+                while (end < size && end - start < MAX_RUN &&
+                        !(end + 2 < size && split[end] == split[end + 1] &&
+                            split[end] == split[end + 2])) {
+                    end++;
+                }
+                if (end == start) {
+                    end++;
+                }
+
+                out.push_back((uint8_t) (start - end));
+                out.insert(out.end(), split.begin() + start, split.begin() + end);
+            }
+
+            start = end;
+        }
+
+        return out;
+    }
+
+    static void appendAttribute(std::vector<uint8_t> &v, const char *name, const char *type,
+            std::vector<uint8_t> const &value) {
+
+        appendString(v, name);
+        appendString(v, type);
+        appendInt32(v, value.size());
+        v.insert(v.end(), value.begin(), value.end());
+    }
+
+    static void appendString(std::vector<uint8_t> &v, const char *s) {
+        v.insert(v.end(), s, s + strlen(s) + 1);
+    }
+
+    static void appendInt32(std::vector<uint8_t> &v, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            v.push_back(value >> i*8);
+        }
+    }
+
+    static void appendUint64(std::vector<uint8_t> &v, uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            v.push_back(value >> i*8);
+        }
+    }
+
+    static void appendFloat(std::vector<uint8_t> &v, float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        appendInt32(v, bits);
+    }
+};
+
+#endif // HDR_WRITER_H
@@ -1,30 +1,153 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <thread>
 #include <vector>
+#include <unordered_map>
 #include <string>
 #include <stdexcept>
 #include <math.h>
-#include "stb_image_write.h"
+#include "PngWriter.h"
+#include "Splat.h"
 #include "util.h"
 
-// Image with 64-bit values for RGB.
+// Image with accumulated RGB and count for each pixel. The four values of a
+// pixel are interleaved as 32-bit integers in a single 16-byte slot, so touching
+// a pixel hits a single cache line. Before a pixel's sums can overflow 32 bits
+// they're spilled into a sparse side table of 64-bit values.
+//
+// By default the pixels are stored in square tiles so that points that are
+// near each other in 2D are near each other in memory. The layout is only
+// converted to row-major when making the final 8-bit image. Tiles are only
+// allocated when first touched, and empty tiles are skipped when adding
+// images and tone mapping, so mostly-empty images are cheap.
 class Image {
+public:
+    // How pixels are arranged in memory.
+    enum class Layout {
+        // One row after another.
+        ROW_MAJOR,
+        // TILE_SIZE by TILE_SIZE tiles, each stored row by row and allocated
+        // on first touch. Partial tiles on the right and bottom are padded out.
+        TILED,
+    };
+
+    static const int TILE_SIZE = 32;
+
+    // Largest number of pixels, including the padding of partial tiles, so
+    // that pixel indices and spill keys fit in an int.
+    static const int64_t MAX_PIXEL_COUNT = 0x7FFFFFFF;
+
+private:
+    static const int TILE_SHIFT = 5;
+    static const int TILE_MASK = TILE_SIZE - 1;
+    static const int TILE_PIXELS = TILE_SIZE*TILE_SIZE;
+
+    // A pixel's values as stored in the image.
+    struct CompactPixel {
+        uint32_t red;
+        uint32_t green;
+        uint32_t blue;
+        uint32_t count;
+    };
+
+    // A pixel's values as stored in the spill table.
+    struct WidePixel {
+        uint64_t red;
+        uint64_t green;
+        uint64_t blue;
+        uint64_t count;
+    };
+
+    // Each touch adds at most 0xFFFF to the sums, so a compact pixel with
+    // at most this count can't have overflowed.
+    static constexpr uint32_t SPILL_COUNT = 0x10000;
+
     int mWidth;
     int mHeight;
     int mPixelCount;
-    std::vector<uint64_t> mRed;
-    std::vector<uint64_t> mGreen;
-    std::vector<uint64_t> mBlue;
-    std::vector<uint64_t> mCount;
+    Layout mLayout;
+    int mTilesAcross;
+    int mTileCount;
+    // For ROW_MAJOR, one row after another.
+    std::vector<CompactPixel> mPixels;
+    // For TILED, each tile in row-major order of tiles, or null if empty.
+    std::vector<std::unique_ptr<CompactPixel[]>> mTiles;
+    // Keyed by pixel index (see getIndex()). The pixel's total is the
+    // sum of both.
+    std::unordered_map<int, WidePixel> mSpill;
 
 public:
-    Image(int width, int height)
-        : mWidth(width), mHeight(height), mPixelCount(width*height),
-        mRed(mPixelCount), mGreen(mPixelCount), mBlue(mPixelCount), mCount(mPixelCount)
+    /**
+     * The size must be supported (see isSizeSupported()).
+     */
+    Image(int width, int height, Layout layout = Layout::TILED)
+        : mWidth(width), mHeight(height), mPixelCount(0),
+        mLayout(layout), mTilesAcross(0), mTileCount(0)
     {
-        // Nothing.
+        if (!isSizeSupported(width, height)) {
+            throw std::logic_error("The image is too large");
+        }
+        mPixelCount = width*height;
+        mTilesAcross = (width + TILE_MASK) >> TILE_SHIFT;
+        mTileCount = mTilesAcross*((height + TILE_MASK) >> TILE_SHIFT);
+
+        if (layout == Layout::TILED) {
+            mTiles.resize(mTileCount);
+        } else {
+            mPixels.resize(mPixelCount);
+        }
+    }
+
+    /**
+     * Returns whether an image can be "width" by "height" pixels, which is
+     * at most MAX_PIXEL_COUNT pixels after padding to whole tiles.
+     */
+    static bool isSizeSupported(int64_t width, int64_t height) {
+        int64_t paddedWidth = (width + TILE_MASK) >> TILE_SHIFT << TILE_SHIFT;
+        int64_t paddedHeight = (height + TILE_MASK) >> TILE_SHIFT << TILE_SHIFT;
+
+        return width >= 0 && height >= 0 &&
+            (width == 0 || paddedHeight <= MAX_PIXEL_COUNT/paddedWidth);
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    /**
+     * Approximate number of bytes used by the accumulated values.
+     */
+    uint64_t getByteCount() const {
+        uint64_t byteCount = mPixels.size()*sizeof(CompactPixel) +
+            mTiles.size()*sizeof(mTiles[0]) +
+            mSpill.size()*(sizeof(int) + sizeof(WidePixel));
+
+        for (auto const &tile : mTiles) {
+            if (tile) {
+                byteCount += TILE_PIXELS*sizeof(CompactPixel);
+            }
+        }
+
+        return byteCount;
+    }
+
+    /**
+     * Zero every pixel, keeping allocated tiles for reuse.
+     */
+    void clear() {
+        forEachRun([](int, CompactPixel *pixels, int count) {
+            std::fill(pixels, pixels + count, CompactPixel());
+        });
+        mSpill.clear();
     }
 
     /**
@@ -38,12 +161,41 @@ public:
      * Add some color to a pixel.
      */
     void touchPixel(int x, int y, linear_color red, linear_color green, linear_color blue) {
-        int index = y*mWidth + x;
+        int index = getIndex(x, y);
+        CompactPixel &pixel = getPixelForWrite(index);
+
+        if (pixel.count == SPILL_COUNT) {
+            spill(index);
+        }
+
+        pixel.red += red;
+        pixel.green += green;
+        pixel.blue += blue;
+        pixel.count += 1;
+    }
+
+    /**
+     * Add a batch of colors to their pixels.
+     */
+    void touchPixels(const Splat *splats, int count) {
+        for (int i = 0; i < count; i++) {
+            const Splat &splat = splats[i];
+            touchPixel(splat.x, splat.y, splat.red, splat.green, splat.blue);
+        }
+    }
+
+    /**
+     * Add the sums of "count" points to a pixel.
+     */
+    void addPoints(int x, int y, uint64_t red, uint64_t green, uint64_t blue, uint64_t count) {
+        int index = getIndex(x, y);
 
-        mRed[index] += red;
-        mGreen[index] += green;
-        mBlue[index] += blue;
-        mCount[index] += 1;
+        if (count <= SPILL_COUNT) {
+            CompactPixel other = { (uint32_t) red, (uint32_t) green, (uint32_t) blue, (uint32_t) count };
+            addPixel(index, getPixelForWrite(index), other);
+        } else {
+            addSpill(index, WidePixel{ red, green, blue, count });
+        }
     }
 
     // Add other image data to ours.
@@ -52,11 +204,202 @@ public:
             throw std::logic_error("The image sizes must match");
         }
 
-        for (int i = 0; i < mPixelCount; i++) {
-            mRed[i] += other.mRed[i];
-            mGreen[i] += other.mGreen[i];
-            mBlue[i] += other.mBlue[i];
-            mCount[i] += other.mCount[i];
+        addRows(other, 0);
+    }
+
+    /**
+     * Add several images of our size and layout to ours, with "threadCount"
+     * threads that each sum a share of the tiles. Returns our largest
+     * component after brightening, like brightenDarks() would make it, so
+     * that tone mapping doesn't need another pass over the pixels. The
+     * returned value only covers our pixels that the others touched, so
+     * it's our whole maximum if we started empty.
+     */
+    double addAll(std::vector<const Image *> const &others, int threadCount) {
+        for (const Image *other : others) {
+            if (other->mWidth != mWidth || other->mHeight != mHeight ||
+                    other->mLayout != mLayout) {
+
+                throw std::logic_error("The image sizes and layouts must match");
+            }
+        }
+
+        // Runs of TILE_PIXELS pixels: whole tiles, or parts of our rows.
+        int pixelCount = mLayout == Layout::TILED ? mTileCount*TILE_PIXELS : mPixelCount;
+        int runCount = (pixelCount + TILE_PIXELS - 1) >> (2*TILE_SHIFT);
+        std::atomic<int> nextRun(0);
+        std::vector<std::unordered_map<int, WidePixel>> spills(threadCount);
+        std::vector<double> maxes(threadCount);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount; t++) {
+            threads.emplace_back([&, t]() {
+                // Take a few runs at a time, since dense and empty parts of
+                // the image take very different times.
+                const int RUNS_PER_TAKE = 16;
+                int firstRun;
+                while ((firstRun = nextRun.fetch_add(RUNS_PER_TAKE)) < runCount) {
+                    int lastRun = std::min(firstRun + RUNS_PER_TAKE, runCount);
+
+                    for (int run = firstRun; run < lastRun; run++) {
+                        maxes[t] = std::max(maxes[t], addRun(others, run, spills[t]));
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        // The spill table isn't thread-safe, so fill it afterward.
+        double max = 0;
+        for (int t = 0; t < threadCount; t++) {
+            for (auto const &entry : spills[t]) {
+                addSpill(entry.first, entry.second);
+            }
+            max = std::max(max, maxes[t]);
+        }
+        for (const Image *other : others) {
+            for (auto const &entry : other->mSpill) {
+                addSpill(entry.first, entry.second);
+            }
+        }
+
+        // The runs skipped spilled pixels.
+        for (auto const &entry : mSpill) {
+            WidePixel pixel = getPixel(entry.first);
+            uint64_t component = std::max(pixel.red, std::max(pixel.green, pixel.blue));
+            max = std::max(max, component*log(1.0 + pixel.count)/pixel.count);
+        }
+
+        return max;
+    }
+
+    // Add other image data to our rows starting at "firstRow". The other
+    // image must be as wide as ours. Fastest when both have the same layout
+    // and, if tiled, "firstRow" is a multiple of TILE_SIZE.
+    void addRows(const Image &other, int firstRow) {
+        if (other.mWidth != mWidth || firstRow < 0 ||
+                firstRow + other.mHeight > mHeight) {
+
+            throw std::logic_error("The rows must fit in the image");
+        }
+
+        if (other.mLayout == mLayout &&
+                (mLayout == Layout::ROW_MAJOR || (firstRow & TILE_MASK) == 0)) {
+
+            // Each of other's runs of pixels is a run of ours. Any padding
+            // in other's last row of tiles is zero.
+            int offset = mLayout == Layout::ROW_MAJOR
+                ? firstRow*mWidth
+                : (firstRow >> TILE_SHIFT)*mTilesAcross*TILE_PIXELS;
+
+            other.forEachRun([&](int index, const CompactPixel *pixels, int count) {
+                CompactPixel *ours = &getPixelForWrite(offset + index);
+
+                for (int i = 0; i < count; i++) {
+                    addPixel(offset + index + i, ours[i], pixels[i]);
+                }
+            });
+
+            for (auto const &entry : other.mSpill) {
+                addSpill(offset + entry.first, entry.second);
+            }
+        } else {
+            other.forEachPixel([&](int x, int y, const CompactPixel *pixel) {
+                if (pixel != nullptr) {
+                    int index = getIndex(x, firstRow + y);
+                    addPixel(index, getPixelForWrite(index), *pixel);
+                }
+            });
+
+            for (auto const &entry : other.mSpill) {
+                int x, y;
+                other.getXY(entry.first, x, y);
+                addSpill(getIndex(x, firstRow + y), entry.second);
+            }
+        }
+    }
+
+    /**
+     * Copy the red, green and blue sums and count of each pixel of row "y"
+     * to "values", four per pixel. Only call before brightening.
+     */
+    void readRow(int y, uint64_t *values) const {
+        readRow(y, 0, mWidth, values);
+    }
+
+    /**
+     * Like readRow(), but only the "count" pixels from "left".
+     */
+    void readRow(int y, int left, int count, uint64_t *values) const {
+        for (int x = 0; x < count; x++) {
+            int index = getIndex(left + x, y);
+            const CompactPixel *pixel = getPixelForRead(index);
+
+            if (!mSpill.empty()) {
+                WidePixel wide = getPixel(index);
+                values[x*4 + 0] = wide.red;
+                values[x*4 + 1] = wide.green;
+                values[x*4 + 2] = wide.blue;
+                values[x*4 + 3] = wide.count;
+            } else if (pixel != nullptr) {
+                values[x*4 + 0] = pixel->red;
+                values[x*4 + 1] = pixel->green;
+                values[x*4 + 2] = pixel->blue;
+                values[x*4 + 3] = pixel->count;
+            } else {
+                values[x*4 + 0] = 0;
+                values[x*4 + 1] = 0;
+                values[x*4 + 2] = 0;
+                values[x*4 + 3] = 0;
+            }
+        }
+    }
+
+    /**
+     * Add the pixels of "source", an image twice our size, summed in 2x2
+     * blocks. Our rows are rows "firstRow" onward of the half-size image.
+     * Only the source's allocated tiles and spilled pixels are visited.
+     * Only call before brightening.
+     */
+    void addHalfSize(const Image &source, int firstRow) {
+        int firstSourceRow = firstRow*2;
+        int endSourceRow = std::min((firstRow + mHeight)*2, source.mHeight);
+
+        source.forEachRun([&](int index, const CompactPixel *pixels, int count) {
+            int x, y;
+            source.getXY(index, x, y);
+
+            // Skip tiles entirely outside our rows.
+            if (source.mLayout == Layout::TILED &&
+                    (y + TILE_SIZE <= firstSourceRow || y >= endSourceRow)) {
+
+                return;
+            }
+
+            for (int i = 0; i < count; i++) {
+                const CompactPixel &pixel = pixels[i];
+
+                // Padding is never touched, so has no points.
+                if (pixel.count > 0) {
+                    source.getXY(index + i, x, y);
+                    if (y >= firstSourceRow && y < endSourceRow) {
+                        addPoints(x/2, y/2 - firstRow,
+                                pixel.red, pixel.green, pixel.blue, pixel.count);
+                    }
+                }
+            }
+        });
+
+        for (auto const &entry : source.mSpill) {
+            int x, y;
+            source.getXY(entry.first, x, y);
+
+            if (y >= firstSourceRow && y < endSourceRow) {
+                WidePixel const &pixel = entry.second;
+                addPoints(x/2, y/2 - firstRow, pixel.red, pixel.green, pixel.blue, pixel.count);
+            }
         }
     }
 
@@ -64,33 +407,109 @@ public:
      * Multiply image by log of its count so that darks get brighter.
      */
     void brightenDarks() {
-        for (int i = 0; i < mPixelCount; i++) {
-            uint64_t count = mCount[i];
+        // Move compact values of spilled pixels to the spill table so that
+        // the compact pass below skips them.
+        for (auto const &entry : mSpill) {
+            spill(entry.first);
+        }
+
+        forEachRun([](int, CompactPixel *pixels, int runCount) {
+            for (int i = 0; i < runCount; i++) {
+                CompactPixel &pixel = pixels[i];
+                uint32_t count = pixel.count;
 
-            if (count > 0) {
-                // Multiply by log to brighten the darks and simulate film
-                // exposure. Add 1 to avoid negative values.
-                double mult = log(1.0 + count)/count;
+                if (count > 0) {
+                    // Multiply by log to brighten the darks and simulate film
+                    // exposure. Add 1 to avoid negative values.
+                    double mult = log(1.0 + count)/count;
 
-                mRed[i] = (int) (mRed[i]*mult);
-                mGreen[i] = (int) (mGreen[i]*mult);
-                mBlue[i] = (int) (mBlue[i]*mult);
+                    pixel.red = (int) (pixel.red*mult);
+                    pixel.green = (int) (pixel.green*mult);
+                    pixel.blue = (int) (pixel.blue*mult);
+                }
             }
+        });
+
+        // The brightened sums are at most 0xFFFF*log(1 + count), so they
+        // fit back into the compact pixel. Only the count stays spilled.
+        for (auto &entry : mSpill) {
+            CompactPixel &pixel = getPixelForWrite(entry.first);
+            WidePixel &wide = entry.second;
+            double mult = log(1.0 + wide.count)/wide.count;
+
+            pixel.red = (uint32_t) (wide.red*mult);
+            pixel.green = (uint32_t) (wide.green*mult);
+            pixel.blue = (uint32_t) (wide.blue*mult);
+            wide.red = 0;
+            wide.green = 0;
+            wide.blue = 0;
         }
     }
 
+    /**
+     * Copy the brightened sums to "rgb" in row-major order. Only call after
+     * brightenDarks(), when they all fit in 32 bits.
+     */
+    void toLinearRgb(uint32_t *rgb) const {
+        forEachPixel([&](int x, int y, const CompactPixel *pixel) {
+            uint64_t i = (uint64_t) y*mWidth + x;
+
+            if (pixel == nullptr) {
+                rgb[i*3 + 0] = 0;
+                rgb[i*3 + 1] = 0;
+                rgb[i*3 + 2] = 0;
+            } else {
+                rgb[i*3 + 0] = pixel->red;
+                rgb[i*3 + 1] = pixel->green;
+                rgb[i*3 + 2] = pixel->blue;
+            }
+        });
+    }
+
+    /**
+     * Normalize a brightened component by the inverse of the image's
+     * maximum component, and gamma correct it.
+     */
+    static gamma_color toGamma(uint64_t value, double invMax) {
+        return (int) (255.99*sqrt(value*invMax));
+    }
+
     void toRgb(std::vector<gamma_color> &rgb) const {
         // Find max so we can normalize whole image.
-        uint64_t max = getMaxComponent();
+        toRgb(rgb, getMaxComponent());
+    }
+
+    /**
+     * Like toRgb(), but normalize by "max" instead of our own maximum
+     * component, so that several images match.
+     */
+    void toRgb(std::vector<gamma_color> &rgb, uint64_t max) const {
         double invCount = max == 0 ? 0 : 1.0/max;
 
-        rgb.resize(mPixelCount*3);
+        // Background for empty tiles.
+        rgb.assign((uint64_t) mPixelCount*3, 0);
+
+        forEachPixel([&](int x, int y, const CompactPixel *pixel) {
+            if (pixel != nullptr) {
+                uint64_t i = (uint64_t) y*mWidth + x;
+
+                // Gamma correct.
+                rgb[i*3 + 0] = toGamma(pixel->red, invCount);
+                rgb[i*3 + 1] = toGamma(pixel->green, invCount);
+                rgb[i*3 + 2] = toGamma(pixel->blue, invCount);
+            }
+        });
+
+        // Redo spilled pixels with their full values.
+        for (auto const &entry : mSpill) {
+            WidePixel pixel = getPixel(entry.first);
+            int x, y;
+            getXY(entry.first, x, y);
+            uint64_t i = (uint64_t) y*mWidth + x;
 
-        for (int i = 0; i < mPixelCount; i++) {
-            // Gamma correct.
-            rgb[i*3 + 0] = (int) (255.99*sqrt(mRed[i]*invCount));
-            rgb[i*3 + 1] = (int) (255.99*sqrt(mGreen[i]*invCount));
-            rgb[i*3 + 2] = (int) (255.99*sqrt(mBlue[i]*invCount));
+            rgb[i*3 + 0] = toGamma(pixel.red, invCount);
+            rgb[i*3 + 1] = toGamma(pixel.green, invCount);
+            rgb[i*3 + 2] = toGamma(pixel.blue, invCount);
         }
     }
 
@@ -99,41 +518,336 @@ public:
         uint64_t max = getMaxComponent();
         double invCount = max == 0 ? 0 : 1.0/max;
 
-        bgra.resize(mPixelCount*4);
+        bgra.resize((uint64_t) mPixelCount*4);
 
-        for (int i = 0; i < mPixelCount; i++) {
-            // Gamma correct.
-            bgra[i*4 + 0] = (int) (255.99*sqrt(mBlue[i]*invCount));
-            bgra[i*4 + 1] = (int) (255.99*sqrt(mGreen[i]*invCount));
-            bgra[i*4 + 2] = (int) (255.99*sqrt(mRed[i]*invCount));
+        forEachPixel([&](int x, int y, const CompactPixel *pixel) {
+            uint64_t i = (uint64_t) y*mWidth + x;
+
+            if (pixel == nullptr) {
+                // Background.
+                bgra[i*4 + 0] = 0;
+                bgra[i*4 + 1] = 0;
+                bgra[i*4 + 2] = 0;
+            } else {
+                // Gamma correct.
+                bgra[i*4 + 0] = toGamma(pixel->blue, invCount);
+                bgra[i*4 + 1] = toGamma(pixel->green, invCount);
+                bgra[i*4 + 2] = toGamma(pixel->red, invCount);
+            }
             bgra[i*4 + 3] = 255;
+        });
+
+        // Redo spilled pixels with their full values.
+        for (auto const &entry : mSpill) {
+            WidePixel pixel = getPixel(entry.first);
+            int x, y;
+            getXY(entry.first, x, y);
+            uint64_t i = (uint64_t) y*mWidth + x;
+
+            bgra[i*4 + 0] = toGamma(pixel.blue, invCount);
+            bgra[i*4 + 1] = toGamma(pixel.green, invCount);
+            bgra[i*4 + 2] = toGamma(pixel.red, invCount);
         }
     }
 
+    /**
+     * Largest red, green, or blue sum in the image.
+     */
+    uint64_t getMaxComponent() const {
+        uint64_t max = 0;
+
+        forEachRun([&](int, const CompactPixel *pixels, int count) {
+            for (int i = 0; i < count; i++) {
+                const CompactPixel &pixel = pixels[i];
+
+                if (pixel.red > max) max = pixel.red;
+                if (pixel.green > max) max = pixel.green;
+                if (pixel.blue > max) max = pixel.blue;
+            }
+        });
+
+        for (auto const &entry : mSpill) {
+            WidePixel pixel = getPixel(entry.first);
+
+            if (pixel.red > max) max = pixel.red;
+            if (pixel.green > max) max = pixel.green;
+            if (pixel.blue > max) max = pixel.blue;
+        }
+
+        return max;
+    }
+
     // Saves the image to the pathname as a PNG file, returning
     // whether successful.
     bool save(const std::string &pathname) const {
-        std::vector<gamma_color> rgb;
-        toRgb(rgb);
+        return save(pathname, getMaxComponent());
+    }
 
-        int success = stbi_write_png(pathname.c_str(),
-                mWidth, mHeight, 3, &rgb[0], mWidth*3);
+    /**
+     * Like save(), but normalize by "max" instead of our own maximum
+     * component.
+     */
+    bool save(const std::string &pathname, uint64_t max) const {
+        std::vector<gamma_color> rgb;
+        toRgb(rgb, max);
 
-        return success;
+        PngWriter writer;
+        return writer.open(pathname, mWidth, mHeight) &&
+            writer.writeRows(&rgb[0], mHeight) &&
+            writer.close();
     }
 
 private:
-    uint64_t getMaxComponent() const {
-        uint64_t max = 0;
+    /**
+     * Index of pixel (x, y), which is also the spill key.
+     */
+    int getIndex(int x, int y) const {
+        if (mLayout == Layout::TILED) {
+            int tile = (y >> TILE_SHIFT)*mTilesAcross + (x >> TILE_SHIFT);
+            return tile*TILE_PIXELS + ((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+        } else {
+            return y*mWidth + x;
+        }
+    }
+
+    /**
+     * Inverse of getIndex().
+     */
+    void getXY(int index, int &x, int &y) const {
+        if (mLayout == Layout::TILED) {
+            int tile = index/TILE_PIXELS;
+            int offset = index & (TILE_PIXELS - 1);
+            x = (tile % mTilesAcross)*TILE_SIZE + (offset & TILE_MASK);
+            y = (tile/mTilesAcross)*TILE_SIZE + (offset >> TILE_SHIFT);
+        } else {
+            x = index % mWidth;
+            y = index/mWidth;
+        }
+    }
+
+    /**
+     * Call f(x, y, pixel) for every pixel in the image, in memory order,
+     * skipping any padding. The pixel is null for pixels in empty tiles.
+     */
+    template <typename FUNC>
+    void forEachPixel(FUNC f) const {
+        if (mLayout == Layout::TILED) {
+            for (int tileY = 0; tileY < mHeight; tileY += TILE_SIZE) {
+                for (int tileX = 0; tileX < mWidth; tileX += TILE_SIZE) {
+                    const CompactPixel *tile = mTiles[getIndex(tileX, tileY) >> (2*TILE_SHIFT)].get();
+
+                    for (int dy = 0; dy < TILE_SIZE && tileY + dy < mHeight; dy++) {
+                        for (int dx = 0; dx < TILE_SIZE && tileX + dx < mWidth; dx++) {
+                            f(tileX + dx, tileY + dy,
+                                    tile == nullptr ? nullptr : tile + (dy << TILE_SHIFT) + dx);
+                        }
+                    }
+                }
+            }
+        } else {
+            for (int i = 0; i < mPixelCount; i++) {
+                f(i % mWidth, i/mWidth, &mPixels[i]);
+            }
+        }
+    }
+
+    /**
+     * Call f(index, pixels, count) for each run of pixels that are contiguous
+     * in memory, skipping empty tiles. The index is that of the first pixel.
+     */
+    template <typename FUNC>
+    void forEachRun(FUNC f) {
+        if (mLayout == Layout::TILED) {
+            for (int tile = 0; tile < mTileCount; tile++) {
+                if (mTiles[tile]) {
+                    f(tile*TILE_PIXELS, mTiles[tile].get(), TILE_PIXELS);
+                }
+            }
+        } else {
+            f(0, &mPixels[0], mPixelCount);
+        }
+    }
+
+    template <typename FUNC>
+    void forEachRun(FUNC f) const {
+        const_cast<Image *>(this)->forEachRun(
+                [&f](int index, const CompactPixel *pixels, int count) {
+                    f(index, pixels, count);
+                });
+    }
+
+    /**
+     * The pixel at "index", allocating its tile if necessary.
+     */
+    CompactPixel &getPixelForWrite(int index) {
+        if (mLayout == Layout::TILED) {
+            std::unique_ptr<CompactPixel[]> &tile = mTiles[index >> (2*TILE_SHIFT)];
+            if (!tile) {
+                tile.reset(new CompactPixel[TILE_PIXELS]());
+            }
+            return tile[index & (TILE_PIXELS - 1)];
+        } else {
+            return mPixels[index];
+        }
+    }
 
-        for (int i = 0; i < mPixelCount; i++) {
-            if (mRed[i] > max) max = mRed[i];
-            if (mGreen[i] > max) max = mGreen[i];
-            if (mBlue[i] > max) max = mBlue[i];
+    /**
+     * The pixel at "index", or null if its tile is empty.
+     */
+    const CompactPixel *getPixelForRead(int index) const {
+        if (mLayout == Layout::TILED) {
+            const CompactPixel *tile = mTiles[index >> (2*TILE_SHIFT)].get();
+            return tile == nullptr ? nullptr : tile + (index & (TILE_PIXELS - 1));
+        } else {
+            return &mPixels[index];
+        }
+    }
+
+    /**
+     * Add run "run" of each of the other images to ours, moving pixels that
+     * would overflow to "spill" instead of our spill table. Returns the
+     * largest brightened component of the run's pixels that have no spilled
+     * values anywhere.
+     */
+    double addRun(std::vector<const Image *> const &others, int run,
+            std::unordered_map<int, WidePixel> &spill) {
+
+        int index = run << (2*TILE_SHIFT);
+        int count = std::min(TILE_PIXELS, mLayout == Layout::TILED
+                ? TILE_PIXELS : mPixelCount - index);
+        CompactPixel *ours = nullptr;
+
+        for (const Image *other : others) {
+            const CompactPixel *theirs = other->getPixelForRead(index);
+            if (theirs == nullptr) {
+                continue;
+            }
+            if (ours == nullptr) {
+                ours = &getPixelForWrite(index);
+            }
+
+            for (int i = 0; i < count; i++) {
+                CompactPixel &pixel = ours[i];
+
+                if (pixel.count + theirs[i].count > SPILL_COUNT) {
+                    WidePixel &wide = spill[index + i];
+                    wide.red += pixel.red;
+                    wide.green += pixel.green;
+                    wide.blue += pixel.blue;
+                    wide.count += pixel.count;
+                    pixel = CompactPixel();
+                }
+
+                pixel.red += theirs[i].red;
+                pixel.green += theirs[i].green;
+                pixel.blue += theirs[i].blue;
+                pixel.count += theirs[i].count;
+            }
+        }
+
+        if (ours == nullptr) {
+            return 0;
+        }
+
+        double max = 0;
+        for (int i = 0; i < count; i++) {
+            const CompactPixel &pixel = ours[i];
+            uint32_t component = std::max(pixel.red, std::max(pixel.green, pixel.blue));
+
+            if (component > 0 && !isSpilled(index + i, others, spill)) {
+                max = std::max(max, component*log(1.0 + pixel.count)/pixel.count);
+            }
         }
 
         return max;
     }
+
+    /**
+     * Whether the pixel at "index" has spilled values in our spill table,
+     * any of the others', or "spill".
+     */
+    bool isSpilled(int index, std::vector<const Image *> const &others,
+            std::unordered_map<int, WidePixel> const &spill) const {
+
+        if (!spill.empty() && spill.count(index) != 0) {
+            return true;
+        }
+        if (!mSpill.empty() && mSpill.count(index) != 0) {
+            return true;
+        }
+        for (const Image *other : others) {
+            if (!other->mSpill.empty() && other->mSpill.count(index) != 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Add the values of another compact pixel to ours, which is at "index".
+     */
+    void addPixel(int index, CompactPixel &pixel, const CompactPixel &otherPixel) {
+        if (pixel.count + otherPixel.count > SPILL_COUNT) {
+            spill(index);
+        }
+
+        pixel.red += otherPixel.red;
+        pixel.green += otherPixel.green;
+        pixel.blue += otherPixel.blue;
+        pixel.count += otherPixel.count;
+    }
+
+    /**
+     * Add spilled values to the spill table entry at "index".
+     */
+    void addSpill(int index, const WidePixel &otherWide) {
+        WidePixel &wide = mSpill[index];
+
+        wide.red += otherWide.red;
+        wide.green += otherWide.green;
+        wide.blue += otherWide.blue;
+        wide.count += otherWide.count;
+    }
+
+    /**
+     * Move the compact values of the pixel at "index" into the spill table.
+     */
+    void spill(int index) {
+        CompactPixel &pixel = getPixelForWrite(index);
+        WidePixel &wide = mSpill[index];
+
+        wide.red += pixel.red;
+        wide.green += pixel.green;
+        wide.blue += pixel.blue;
+        wide.count += pixel.count;
+
+        pixel = CompactPixel();
+    }
+
+    /**
+     * The full values of the pixel at "index", including any spilled values.
+     */
+    WidePixel getPixel(int index) const {
+        const CompactPixel *pixel = getPixelForRead(index);
+        WidePixel wide = WidePixel();
+
+        if (!mSpill.empty()) {
+            auto itr = mSpill.find(index);
+            if (itr != mSpill.end()) {
+                wide = itr->second;
+            }
+        }
+
+        if (pixel != nullptr) {
+            wide.red += pixel->red;
+            wide.green += pixel->green;
+            wide.blue += pixel->blue;
+            wide.count += pixel->count;
+        }
+
+        return wide;
+    }
 };
 
 #endif // IMAGE_H
@@ -0,0 +1,85 @@
+#ifndef LAYERED_IMAGE_H
+#define LAYERED_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Image.h"
+#include "util.h"
+
+/**
+ * Image split into layers by which attractor moved each point there, so that
+ * the contribution of each attractor, or group of attractors, can be saved
+ * separately. The layers add up to the whole image, and since they're tiled
+ * images, layers that only cover part of the image are cheap.
+ */
+class LayeredImage {
+    int mWidth;
+    int mHeight;
+    // Layer of each attractor.
+    std::vector<int> mAttractorLayers;
+    std::vector<std::unique_ptr<Image>> mLayers;
+
+public:
+    /**
+     * Every attractor index must map to a layer below "layerCount".
+     */
+    LayeredImage(int width, int height, std::vector<int> const &attractorLayers,
+            int layerCount)
+        : mWidth(width), mHeight(height), mAttractorLayers(attractorLayers) {
+
+        for (int layer = 0; layer < layerCount; layer++) {
+            mLayers.emplace_back(std::make_unique<Image>(width, height));
+        }
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    int getLayerCount() const {
+        return mLayers.size();
+    }
+
+    Image const &getLayer(int layer) const {
+        return *mLayers[layer];
+    }
+
+    uint64_t getByteCount() const {
+        uint64_t byteCount = 0;
+
+        for (auto const &layer : mLayers) {
+            byteCount += layer->getByteCount();
+        }
+
+        return byteCount;
+    }
+
+    bool isInBounds(int x, int y) const {
+        return x >= 0 && y >= 0 && x < mWidth && y < mHeight;
+    }
+
+    /**
+     * Add some color to a pixel of the layer of attractor "attractorIndex".
+     */
+    void touchPixel(int x, int y, int attractorIndex,
+            linear_color red, linear_color green, linear_color blue) {
+
+        mLayers[mAttractorLayers[attractorIndex]]->touchPixel(x, y, red, green, blue);
+    }
+
+    /**
+     * Add all layers to a whole image.
+     */
+    void addTo(Image &image) const {
+        for (auto const &layer : mLayers) {
+            image.add(*layer);
+        }
+    }
+};
+
+#endif // LAYERED_IMAGE_H
@@ -0,0 +1,91 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * File mapped into memory, so that the OS can page it in and out and it can
+ * be much larger than physical memory.
+ */
+class MappedFile {
+    int mFd;
+    uint8_t *mData;
+    uint64_t mSize;
+
+public:
+    MappedFile()
+        : mFd(-1), mData(nullptr), mSize(0) {
+
+        // Nothing.
+    }
+
+    ~MappedFile() {
+        if (mData != nullptr) {
+            munmap(mData, mSize);
+        }
+        if (mFd != -1) {
+            close(mFd);
+        }
+    }
+
+    /**
+     * Create (or truncate) the file with the given size and map it read-write,
+     * returning whether successful.
+     */
+    bool create(const std::string &pathname, uint64_t size) {
+        mFd = ::open(pathname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (mFd == -1 || ftruncate(mFd, size) == -1) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        return map(pathname, size, PROT_READ | PROT_WRITE);
+    }
+
+    /**
+     * Map an existing file read-only, returning whether successful.
+     */
+    bool open(const std::string &pathname) {
+        struct stat statbuf;
+        mFd = ::open(pathname.c_str(), O_RDONLY);
+        if (mFd == -1 || fstat(mFd, &statbuf) == -1) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        return map(pathname, statbuf.st_size, PROT_READ);
+    }
+
+    uint8_t *getData() const {
+        return mData;
+    }
+
+    uint64_t getSize() const {
+        return mSize;
+    }
+
+private:
+    bool map(const std::string &pathname, uint64_t size, int protection) {
+        mSize = size;
+        if (size == 0) {
+            return true;
+        }
+
+        void *data = mmap(nullptr, size, protection, MAP_SHARED, mFd, 0);
+        if (data == MAP_FAILED) {
+            perror(pathname.c_str());
+            return false;
+        }
+        mData = (uint8_t *) data;
+
+        return true;
+    }
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,77 @@
+#ifndef MIP_PYRAMID_H
+#define MIP_PYRAMID_H
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include "Image.h"
+
+/**
+ * Smaller copies of an accumulated image, each half the size of the one
+ * before, made by summing the counts and colors of 2x2 blocks. Since they're
+ * summed before brightening, each level can be brightened on its own and
+ * looks like a render at that size.
+ */
+class MipPyramid {
+    // Level 1 (half size) onward.
+    std::vector<std::unique_ptr<Image>> mLevels;
+
+public:
+    /**
+     * Make "levelCount" levels below the image, which must not have been
+     * brightened yet, using "threadCount" threads.
+     */
+    MipPyramid(const Image &image, int levelCount, int threadCount) {
+        const Image *previous = &image;
+
+        for (int level = 1; level <= levelCount; level++) {
+            mLevels.push_back(makeHalfSize(*previous, threadCount));
+            previous = mLevels.back().get();
+        }
+    }
+
+    int getLevelCount() const {
+        return mLevels.size();
+    }
+
+    /**
+     * The image at 1/2^level size, for levels 1 onward.
+     */
+    Image &getLevel(int level) {
+        return *mLevels[level - 1];
+    }
+
+private:
+    /**
+     * Sum the image in 2x2 blocks, each thread doing a band of rows that are
+     * then added to the half-size image.
+     */
+    static std::unique_ptr<Image> makeHalfSize(const Image &image, int threadCount) {
+        int width = (image.getWidth() + 1)/2;
+        int height = (image.getHeight() + 1)/2;
+        auto halfImage = std::make_unique<Image>(width, height);
+
+        // Whole tiles, so that the bands are quick to add.
+        int bandHeight = (height + threadCount - 1)/threadCount;
+        bandHeight = (bandHeight + Image::TILE_SIZE - 1)/Image::TILE_SIZE*Image::TILE_SIZE;
+
+        std::vector<std::unique_ptr<Image>> bands;
+        std::vector<std::thread> threads;
+        for (int firstRow = 0; firstRow < height; firstRow += bandHeight) {
+            int rowCount = height - firstRow < bandHeight ? height - firstRow : bandHeight;
+
+            bands.emplace_back(std::make_unique<Image>(width, rowCount));
+            threads.emplace_back(&Image::addHalfSize, bands.back().get(),
+                    std::cref(image), firstRow);
+        }
+
+        for (unsigned band = 0; band < bands.size(); band++) {
+            threads[band].join();
+            halfImage->addRows(*bands[band], band*bandHeight);
+        }
+
+        return halfImage;
+    }
+};
+
+#endif // MIP_PYRAMID_H
@@ -0,0 +1,115 @@
+#ifndef OUT_OF_CORE_IMAGE_H
+#define OUT_OF_CORE_IMAGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "Image.h"
+#include "MappedFile.h"
+#include "PngWriter.h"
+#include "util.h"
+
+/**
+ * Image too big to accumulate in memory all at once. It's rendered one band
+ * of rows at a time. Each finished band is brightened and stored in a
+ * memory-mapped scratch file, which the OS can page out. Once all bands are
+ * done and the brightest component is known, the bands are streamed from
+ * the scratch file to the PNG file.
+ */
+class OutOfCoreImage {
+    int mWidth;
+    int mHeight;
+    int mBandHeight;
+    // Brightened RGB in row-major order, 32 bits per component.
+    MappedFile mScratch;
+    uint64_t mMax;
+
+public:
+    /**
+     * The band height must be a multiple of Image::TILE_SIZE.
+     */
+    OutOfCoreImage(int width, int height, int bandHeight)
+        : mWidth(width), mHeight(height), mBandHeight(bandHeight), mMax(0) {
+
+        // Nothing.
+    }
+
+    /**
+     * Create the scratch file, returning whether successful. The file is
+     * deleted right away and disappears when we do.
+     */
+    bool create(const std::string &scratchPathname) {
+        bool success = mScratch.create(scratchPathname,
+                (uint64_t) mWidth*mHeight*3*sizeof(uint32_t));
+        unlink(scratchPathname.c_str());
+
+        return success;
+    }
+
+    int getBandCount() const {
+        return (mHeight + mBandHeight - 1)/mBandHeight;
+    }
+
+    int getBandFirstRow(int band) const {
+        return band*mBandHeight;
+    }
+
+    int getBandRowCount(int band) const {
+        int firstRow = getBandFirstRow(band);
+        return mHeight - firstRow < mBandHeight ? mHeight - firstRow : mBandHeight;
+    }
+
+    /**
+     * Brighten the finished band (an image of its rows) and store it.
+     */
+    void storeBand(int band, Image &image) {
+        image.brightenDarks();
+
+        uint64_t max = image.getMaxComponent();
+        if (max > mMax) {
+            mMax = max;
+        }
+
+        image.toLinearRgb(getRow(getBandFirstRow(band)));
+    }
+
+    /**
+     * Saves the image to the pathname as a PNG file, returning whether
+     * successful. All bands must have been stored.
+     */
+    bool save(const std::string &pathname) const {
+        double invMax = mMax == 0 ? 0 : 1.0/mMax;
+
+        PngWriter writer;
+        if (!writer.open(pathname, mWidth, mHeight)) {
+            return false;
+        }
+
+        std::vector<gamma_color> rgb;
+        for (int band = 0; band < getBandCount(); band++) {
+            int rowCount = getBandRowCount(band);
+            uint64_t componentCount = (uint64_t) rowCount*mWidth*3;
+            const uint32_t *linear = getRow(getBandFirstRow(band));
+
+            rgb.resize(componentCount);
+            for (uint64_t i = 0; i < componentCount; i++) {
+                rgb[i] = Image::toGamma(linear[i], invMax);
+            }
+
+            if (!writer.writeRows(&rgb[0], rowCount)) {
+                return false;
+            }
+        }
+
+        return writer.close();
+    }
+
+private:
+    uint32_t *getRow(int y) const {
+        return (uint32_t *) mScratch.getData() + (uint64_t) y*mWidth*3;
+    }
+};
+
+#endif // OUT_OF_CORE_IMAGE_H
@@ -0,0 +1,247 @@
+#ifndef PALETTE_IMAGE_H
+#define PALETTE_IMAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "ColorMap.h"
+#include "Image.h"
+
+/**
+ * Image that keeps, for each pixel, a coarse histogram of where in the color
+ * map its points fell, instead of their colors. The colors are only looked up
+ * when making a normal image, so the same render can be recolored with any
+ * color map in a fraction of a second.
+ *
+ * Each bin covers BIN_WIDTH adjacent color map entries and also keeps the
+ * average position of its points within those entries, where the color map
+ * is sampled when coloring. Since a pixel's points tend to come from a narrow
+ * range of the color map, that's close to coloring each point separately.
+ *
+ * A pixel's bins take 64 bytes, four times an Image pixel, so like Image the
+ * pixels are stored in tiles that are only allocated when first touched.
+ * Counts that would overflow 32 bits are carried into a sparse side table.
+ */
+class PaletteImage {
+    static const int ENTRY_COUNT = 256;
+    static const int BIN_COUNT = 8;
+    static const int BIN_WIDTH = ENTRY_COUNT/BIN_COUNT;
+    // Positions are only summed up to this count so that the sum fits
+    // in 32 bits. The average has long settled by then.
+    static const uint32_t POSITION_COUNT = 0xFFFFFFFF/BIN_WIDTH;
+    static const int TILE_SIZE = Image::TILE_SIZE;
+    static const int TILE_PIXELS = TILE_SIZE*TILE_SIZE;
+
+    struct Bin {
+        uint32_t count;
+        // Sum of the first POSITION_COUNT positions within the bin.
+        uint32_t positionSum;
+    };
+
+    int mWidth;
+    int mHeight;
+    int mTilesAcross;
+    // Each tile in row-major order of tiles, or null if empty. A tile has
+    // BIN_COUNT bins per pixel, with its pixels in row-major order.
+    std::vector<std::unique_ptr<Bin[]>> mTiles;
+    // Keyed by bin index within all tiles. The bin's count is the sum of
+    // both.
+    std::unordered_map<uint64_t, uint64_t> mSpill;
+
+public:
+    PaletteImage(int width, int height)
+        : mWidth(width), mHeight(height), mTilesAcross((width + TILE_SIZE - 1)/TILE_SIZE) {
+
+        mTiles.resize((uint64_t) mTilesAcross*((height + TILE_SIZE - 1)/TILE_SIZE));
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    uint64_t getByteCount() const {
+        uint64_t byteCount = mTiles.size()*sizeof(mTiles[0]) +
+            mSpill.size()*(sizeof(uint64_t)*2);
+
+        for (auto const &tile : mTiles) {
+            if (tile) {
+                byteCount += TILE_PIXELS*BIN_COUNT*sizeof(Bin);
+            }
+        }
+
+        return byteCount;
+    }
+
+    bool isInBounds(int x, int y) const {
+        return x >= 0 && y >= 0 && x < mWidth && y < mHeight;
+    }
+
+    /**
+     * Empty every bin, keeping allocated tiles for reuse.
+     */
+    void clear() {
+        for (auto &tile : mTiles) {
+            if (tile) {
+                std::fill(tile.get(), tile.get() + TILE_PIXELS*BIN_COUNT, Bin());
+            }
+        }
+        mSpill.clear();
+    }
+
+    /**
+     * Add the bins of another image of the same size to ours. Where the
+     * combined positions would overflow, the position sum is rescaled to
+     * keep the combined average.
+     */
+    void add(const PaletteImage &other) {
+        for (uint64_t tile = 0; tile < mTiles.size(); tile++) {
+            const Bin *theirs = other.mTiles[tile].get();
+            if (theirs == nullptr) {
+                continue;
+            }
+
+            std::unique_ptr<Bin[]> &ours = mTiles[tile];
+            if (!ours) {
+                ours.reset(new Bin[TILE_PIXELS*BIN_COUNT]());
+            }
+
+            for (int i = 0; i < TILE_PIXELS*BIN_COUNT; i++) {
+                if (theirs[i].count > 0) {
+                    addBin(ours[i], theirs[i], tile*TILE_PIXELS*BIN_COUNT + i);
+                }
+            }
+        }
+
+        for (auto const &entry : other.mSpill) {
+            mSpill[entry.first] += entry.second;
+        }
+    }
+
+    /**
+     * Count a point at color map entry "colorIndex" (0 to 255).
+     */
+    void touchPixel(int x, int y, int colorIndex) {
+        int tile = (y/TILE_SIZE)*mTilesAcross + x/TILE_SIZE;
+        std::unique_ptr<Bin[]> &tileBins = mTiles[tile];
+        if (!tileBins) {
+            tileBins.reset(new Bin[TILE_PIXELS*BIN_COUNT]());
+        }
+
+        int index = ((y % TILE_SIZE)*TILE_SIZE + x % TILE_SIZE)*BIN_COUNT +
+            colorIndex/BIN_WIDTH;
+        Bin &bin = tileBins[index];
+
+        if (bin.count < POSITION_COUNT) {
+            bin.positionSum += colorIndex % BIN_WIDTH;
+        } else if (bin.count == 0xFFFFFFFF) {
+            // Carry all but POSITION_COUNT, so that the position sum stays
+            // frozen.
+            uint64_t key = (uint64_t) tile*TILE_PIXELS*BIN_COUNT + index;
+            mSpill[key] += 0xFFFFFFFF - POSITION_COUNT;
+            bin.count = POSITION_COUNT;
+        }
+        bin.count += 1;
+    }
+
+    /**
+     * Color our points with the color map and add them to an image of the
+     * same size.
+     */
+    void addTo(Image &image, ColorMap const &colorMap) const {
+        for (uint64_t tile = 0; tile < mTiles.size(); tile++) {
+            if (mTiles[tile]) {
+                addTileTo(image, colorMap, tile);
+            }
+        }
+    }
+
+private:
+    /**
+     * Add another image's bin to ours, whose key in the spill table is
+     * "key".
+     */
+    void addBin(Bin &ours, Bin const &theirs, uint64_t key) {
+        uint64_t ourPositions = ours.count < POSITION_COUNT ? ours.count : POSITION_COUNT;
+        uint64_t theirPositions = theirs.count < POSITION_COUNT ? theirs.count : POSITION_COUNT;
+        uint64_t positionSum = (uint64_t) ours.positionSum + theirs.positionSum;
+        uint64_t count = (uint64_t) ours.count + theirs.count;
+
+        if (ourPositions + theirPositions > POSITION_COUNT) {
+            positionSum = positionSum*POSITION_COUNT/(ourPositions + theirPositions);
+        }
+        if (count > 0xFFFFFFFF) {
+            // Carry all but POSITION_COUNT, as in touchPixel().
+            mSpill[key] += count - POSITION_COUNT;
+            count = POSITION_COUNT;
+        }
+
+        ours.positionSum = (uint32_t) positionSum;
+        ours.count = (uint32_t) count;
+    }
+
+    /**
+     * Like addTo(), but only the pixels of one allocated tile.
+     */
+    void addTileTo(Image &image, ColorMap const &colorMap, uint64_t tile) const {
+        int left = (int) (tile % mTilesAcross)*TILE_SIZE;
+        int top = (int) (tile/mTilesAcross)*TILE_SIZE;
+        int right = std::min(left + TILE_SIZE, mWidth);
+        int bottom = std::min(top + TILE_SIZE, mHeight);
+
+        for (int y = top; y < bottom; y++) {
+            for (int x = left; x < right; x++) {
+                int first = ((y - top)*TILE_SIZE + x - left)*BIN_COUNT;
+                const Bin *bins = &mTiles[tile][first];
+                double red = 0;
+                double green = 0;
+                double blue = 0;
+                uint64_t count = 0;
+
+                for (int i = 0; i < BIN_COUNT; i++) {
+                    const Bin &bin = bins[i];
+
+                    if (bin.count > 0) {
+                        uint64_t binCount = bin.count;
+                        if (bin.count >= POSITION_COUNT && !mSpill.empty()) {
+                            auto spill = mSpill.find(tile*TILE_PIXELS*BIN_COUNT + first + i);
+                            if (spill != mSpill.end()) {
+                                binCount += spill->second;
+                            }
+                        }
+
+                        uint32_t positionCount = bin.count < POSITION_COUNT
+                            ? bin.count : POSITION_COUNT;
+                        double position = i*BIN_WIDTH + (double) bin.positionSum/positionCount;
+
+                        // Interpolate between the entries on either side.
+                        int before = (int) position;
+                        int after = before < ENTRY_COUNT - 1 ? before + 1 : before;
+                        double t = position - before;
+
+                        linear_color red0, green0, blue0, red1, green1, blue1;
+                        colorMap.getColor(before, red0, green0, blue0);
+                        colorMap.getColor(after, red1, green1, blue1);
+
+                        red += binCount*(red0 + (red1 - red0)*t);
+                        green += binCount*(green0 + (green1 - green0)*t);
+                        blue += binCount*(blue0 + (blue1 - blue0)*t);
+                        count += binCount;
+                    }
+                }
+
+                if (count > 0) {
+                    image.addPoints(x, y, (uint64_t) red, (uint64_t) green,
+                            (uint64_t) blue, count);
+                }
+            }
+        }
+    }
+};
+
+#endif // PALETTE_IMAGE_H
@@ -0,0 +1,115 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Counts data TLB misses and last-level cache misses of the calling thread
+ * between start() and stop(). Only available on Linux, and only if the
+ * kernel lets us read hardware counters.
+ */
+class PerfCounters {
+    int mTlbFd;
+    int mCacheFd;
+
+public:
+    PerfCounters()
+        : mTlbFd(-1), mCacheFd(-1) {
+
+#ifdef __linux__
+        mTlbFd = open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        mCacheFd = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    ~PerfCounters() {
+        if (mTlbFd != -1) {
+            close(mTlbFd);
+        }
+        if (mCacheFd != -1) {
+            close(mCacheFd);
+        }
+    }
+
+    /**
+     * Whether the counters can be read.
+     */
+    bool isAvailable() const {
+        return mTlbFd != -1 && mCacheFd != -1;
+    }
+
+    /**
+     * Reset the counters and start counting.
+     */
+    void start() {
+#ifdef __linux__
+        if (isAvailable()) {
+            ioctl(mTlbFd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(mCacheFd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(mTlbFd, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(mCacheFd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /**
+     * Stop counting.
+     */
+    void stop() {
+#ifdef __linux__
+        if (isAvailable()) {
+            ioctl(mTlbFd, PERF_EVENT_IOC_DISABLE, 0);
+            ioctl(mCacheFd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+#endif
+    }
+
+    uint64_t getTlbMisses() const {
+        return read(mTlbFd);
+    }
+
+    uint64_t getCacheMisses() const {
+        return read(mCacheFd);
+    }
+
+private:
+#ifdef __linux__
+    /**
+     * Open a disabled counter for this thread, returning -1 on failure.
+     */
+    static int open(uint32_t type, uint64_t config) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    static uint64_t read(int fd) {
+        uint64_t count = 0;
+
+        if (fd == -1 || ::read(fd, &count, sizeof(count)) != sizeof(count)) {
+            return 0;
+        }
+
+        return count;
+    }
+};
+
+#endif // PERF_COUNTERS_H
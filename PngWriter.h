@@ -0,0 +1,361 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Deflate.h"
+#include "util.h"
+
+/**
+ * Writes an 8-bit RGB PNG file a few rows at a time, so that the whole
+ * image never has to be in memory. Rows are compressed in strips, several
+ * at once on separate threads, whose deflate blocks are joined into one
+ * stream.
+ */
+class PngWriter {
+public:
+    // Trade-off between speed and file size.
+    enum class Level {
+        // No compression, for scratch files.
+        STORE,
+        // One filter for every row and short match searches.
+        FAST,
+        // Best filter for each row and moderate match searches.
+        DEFAULT,
+        // Best filter for each row and long match searches.
+        SMALL,
+    };
+
+private:
+    // Rows are compressed in strips of about this many bytes.
+    static const int STRIP_SIZE = 1024*1024;
+
+    FILE *mFile;
+    int mThreadCount;
+    Level mLevel;
+    int mWidth;
+    int mHeight;
+    int mRowCount;
+    uint32_t mAdler;
+    // Previous row, for filtering.
+    std::vector<gamma_color> mPreviousRow;
+
+    // A strip compressed by one thread.
+    struct Strip {
+        std::vector<uint8_t> compressed;
+        uint32_t adler;
+        uint64_t filteredSize;
+    };
+
+public:
+    /**
+     * Compress with up to "threadCount" threads.
+     */
+    PngWriter(int threadCount = 1, Level level = defaultLevel())
+        : mFile(nullptr), mThreadCount(threadCount), mLevel(level) {
+
+        // Nothing.
+    }
+
+    /**
+     * The level of writers that aren't given one, set from the command line.
+     */
+    static Level &defaultLevel() {
+        static Level level = Level::DEFAULT;
+        return level;
+    }
+
+    ~PngWriter() {
+        if (mFile != nullptr) {
+            fclose(mFile);
+        }
+    }
+
+    /**
+     * Create the file and write the header, returning whether successful.
+     */
+    bool open(const std::string &pathname, int width, int height) {
+        mFile = fopen(pathname.c_str(), "wb");
+        if (mFile == nullptr) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        mWidth = width;
+        mHeight = height;
+        mRowCount = 0;
+        mAdler = 1;
+        mPreviousRow.assign(width*3, 0);
+
+        static const uint8_t SIGNATURE[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        fwrite(SIGNATURE, 1, sizeof(SIGNATURE), mFile);
+
+        std::vector<uint8_t> header;
+        appendUint32(header, width);
+        appendUint32(header, height);
+        header.push_back(8);    // Bit depth.
+        header.push_back(2);    // RGB.
+        header.push_back(0);    // Deflate.
+        header.push_back(0);    // Adaptive filtering.
+        header.push_back(0);    // Not interlaced.
+        writeChunk("IHDR", header);
+
+        // Zlib header, 32k window, and the compression level.
+        static const uint8_t LEVEL_FLAGS[] = { 0x01, 0x01, 0x5E, 0xDA };
+        writeChunk("IDAT", std::vector<uint8_t>{ 0x78, LEVEL_FLAGS[(int) mLevel] });
+
+        return !ferror(mFile);
+    }
+
+    /**
+     * Number of rows to pass to writeRows() at a time to keep all threads
+     * busy.
+     */
+    int getRowsPerWrite() const {
+        return getStripRows()*mThreadCount;
+    }
+
+    /**
+     * Write the next "rowCount" rows of RGB pixels, returning whether
+     * successful.
+     */
+    bool writeRows(const gamma_color *rgb, int rowCount) {
+        int stride = mWidth*3;
+        int stripRows = getStripRows();
+        int stripCount = (rowCount + stripRows - 1)/stripRows;
+
+        // Compress a strip per thread at a time, so that the compressed
+        // strips don't take much memory.
+        for (int firstStrip = 0; firstStrip < stripCount; firstStrip += mThreadCount) {
+            int count = std::min(mThreadCount, stripCount - firstStrip);
+            std::vector<Strip> strips(count);
+            std::vector<std::thread> threads;
+
+            for (int i = 0; i < count; i++) {
+                int row = (firstStrip + i)*stripRows;
+                const gamma_color *previous = row == 0
+                    ? &mPreviousRow[0] : rgb + (uint64_t) (row - 1)*stride;
+
+                threads.emplace_back(&PngWriter::compressStrip, this, rgb + (uint64_t) row*stride,
+                        std::min(stripRows, rowCount - row), previous, std::ref(strips[i]));
+            }
+
+            for (int i = 0; i < count; i++) {
+                threads[i].join();
+                mAdler = combineAdler(mAdler, strips[i].adler, strips[i].filteredSize);
+                writeChunk("IDAT", strips[i].compressed);
+            }
+        }
+
+        if (rowCount > 0) {
+            const gamma_color *last = rgb + (uint64_t) (rowCount - 1)*stride;
+            mPreviousRow.assign(last, last + stride);
+        }
+        mRowCount += rowCount;
+
+        return !ferror(mFile);
+    }
+
+    /**
+     * Finish the file, returning whether successful. All rows must have been
+     * written.
+     */
+    bool close() {
+        std::vector<uint8_t> trailer;
+        Deflate deflate(trailer);
+        deflate.finish();
+        appendUint32(trailer, mAdler);
+        writeChunk("IDAT", trailer);
+        writeChunk("IEND", std::vector<uint8_t>());
+
+        bool success = !ferror(mFile) && mRowCount == mHeight;
+        success = fclose(mFile) == 0 && success;
+        mFile = nullptr;
+
+        return success;
+    }
+
+private:
+    int getStripRows() const {
+        return std::max(STRIP_SIZE/(mWidth*3 + 1), 1);
+    }
+
+    /**
+     * Filter and compress "rowCount" rows, the first of which follows
+     * "previous", into "strip".
+     */
+    void compressStrip(const gamma_color *rgb, int rowCount, const gamma_color *previous,
+            Strip &strip) const {
+
+        int stride = mWidth*3;
+        std::vector<uint8_t> filtered((uint64_t) (stride + 1)*rowCount);
+        for (int i = 0; i < rowCount; i++) {
+            const gamma_color *row = rgb + i*stride;
+            filterRow(row, i == 0 ? previous : row - stride, &filtered[i*(stride + 1)]);
+        }
+        strip.adler = getAdler(filtered);
+        strip.filteredSize = filtered.size();
+
+        static const int MAX_CHAINS[] = { 0, 4, 32, 256 };
+        Deflate deflate(strip.compressed, MAX_CHAINS[(int) mLevel]);
+        if (mLevel == Level::STORE) {
+            deflate.storeBlock(&filtered[0], filtered.size());
+        } else {
+            deflate.compressBlock(&filtered[0], filtered.size());
+        }
+        deflate.syncFlush();
+    }
+
+    /**
+     * Filter a row into "out" (filter type byte plus the filtered row). When
+     * storing, the row isn't filtered, and at the fast level it's always
+     * predicted from the row above. Otherwise we use whichever filter gives
+     * the smallest sum of absolute values.
+     */
+    void filterRow(const gamma_color *row, const gamma_color *up, uint8_t *out) const {
+        int stride = mWidth*3;
+        int firstFilter = 0;
+        int lastFilter = 4;
+        if (mLevel == Level::STORE) {
+            lastFilter = 0;
+        } else if (mLevel == Level::FAST) {
+            firstFilter = 2;
+            lastFilter = 2;
+        }
+
+        int bestSum = -1;
+        std::vector<uint8_t> candidate(stride);
+
+        for (int filter = firstFilter; filter <= lastFilter; filter++) {
+            int sum = 0;
+
+            for (int i = 0; i < stride; i++) {
+                int a = i >= 3 ? row[i - 3] : 0;
+                int b = up[i];
+                int c = i >= 3 ? up[i - 3] : 0;
+                int predicted;
+
+                switch (filter) {
+                    default:
+                    case 0: predicted = 0; break;
+                    case 1: predicted = a; break;
+                    case 2: predicted = b; break;
+                    case 3: predicted = (a + b)/2; break;
+                    case 4: predicted = paeth(a, b, c); break;
+                }
+
+                uint8_t value = row[i] - predicted;
+                candidate[i] = value;
+                sum += abs((int8_t) value);
+            }
+
+            if (bestSum == -1 || sum < bestSum) {
+                bestSum = sum;
+                out[0] = filter;
+                std::copy(candidate.begin(), candidate.end(), out + 1);
+            }
+        }
+    }
+
+    static int paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = abs(p - a);
+        int pb = abs(p - b);
+        int pc = abs(p - c);
+
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+
+    static const uint32_t ADLER_BASE = 65521;
+
+    static uint32_t getAdler(const std::vector<uint8_t> &data) {
+        // Most bytes that can be added before the sums could overflow.
+        const uint64_t MAX_RUN = 5552;
+        uint32_t s1 = 1;
+        uint32_t s2 = 0;
+
+        for (uint64_t start = 0; start < data.size(); start += MAX_RUN) {
+            uint64_t end = std::min(start + MAX_RUN, (uint64_t) data.size());
+            for (uint64_t i = start; i < end; i++) {
+                s1 += data[i];
+                s2 += s1;
+            }
+            s1 %= ADLER_BASE;
+            s2 %= ADLER_BASE;
+        }
+
+        return (s2 << 16) | s1;
+    }
+
+    /**
+     * The Adler-32 of two pieces of data joined, from their own checksums
+     * and the size of the second, like zlib's adler32_combine().
+     */
+    static uint32_t combineAdler(uint32_t adler1, uint32_t adler2, uint64_t size2) {
+        uint32_t remainder = size2 % ADLER_BASE;
+        uint32_t s1 = adler1 & 0xFFFF;
+        uint32_t s2 = (uint64_t) remainder*s1 % ADLER_BASE;
+
+        s1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+        s2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - remainder;
+        if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+        if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+        if (s2 >= ADLER_BASE*2) s2 -= ADLER_BASE*2;
+        if (s2 >= ADLER_BASE) s2 -= ADLER_BASE;
+
+        return (s2 << 16) | s1;
+    }
+
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+        static const std::vector<uint32_t> table = makeCrcTable();
+
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    static std::vector<uint32_t> makeCrcTable() {
+        std::vector<uint32_t> table(256);
+
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+
+        return table;
+    }
+
+    static void appendUint32(std::vector<uint8_t> &v, uint32_t value) {
+        v.push_back(value >> 24);
+        v.push_back(value >> 16);
+        v.push_back(value >> 8);
+        v.push_back(value);
+    }
+
+    void writeChunk(const char *type, const std::vector<uint8_t> &data) {
+        std::vector<uint8_t> length;
+        appendUint32(length, data.size());
+        fwrite(&length[0], 1, 4, mFile);
+
+        uint32_t crc = crc32(0, (const uint8_t *) type, 4);
+        crc = crc32(crc, data.data(), data.size());
+        fwrite(type, 1, 4, mFile);
+        fwrite(data.data(), 1, data.size(), mFile);
+
+        std::vector<uint8_t> crcBytes;
+        appendUint32(crcBytes, crc);
+        fwrite(&crcBytes[0], 1, 4, mFile);
+    }
+};
+
+#endif // PNG_WRITER_H
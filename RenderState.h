@@ -0,0 +1,19 @@
+#ifndef RENDER_STATE_H
+#define RENDER_STATE_H
+
+#include <cstdint>
+
+/**
+ * Where a render thread's orbit is, so that it can be continued exactly:
+ * the next iteration, the point and its color, and the thread's random
+ * number generator.
+ */
+struct RenderState {
+    uint64_t iteration = 0;
+    double x = 0;
+    double y = 0;
+    double colorMapValue = 0;
+    unsigned short random[3] = { 0, 0, 0 };
+};
+
+#endif // RENDER_STATE_H
@@ -0,0 +1,139 @@
+#ifndef SHARED_IMAGE_H
+#define SHARED_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Image.h"
+#include "Splat.h"
+#include "util.h"
+
+/**
+ * Image that all render threads touch at once, instead of each thread having
+ * its own full-size image. The rows are split into bands that each have their
+ * own lock, so threads only contend when they touch the same band at the same
+ * time.
+ *
+ * It can also hold just some of the rows of the image, with points in the
+ * other rows being out of bounds.
+ */
+class SharedImage {
+    // A row of the image's tiles, so that bands can be added to the full
+    // image a tile at a time.
+    static const int BAND_HEIGHT = Image::TILE_SIZE;
+
+    struct Band {
+        std::mutex mutex;
+        Image image;
+
+        Band(int width, int height)
+            : image(width, height) {
+
+            // Nothing.
+        }
+    };
+
+    int mWidth;
+    int mHeight;
+    // Rows that we hold.
+    int mFirstRow;
+    int mRowCount;
+    std::vector<std::unique_ptr<Band>> mBands;
+
+public:
+    SharedImage(int width, int height)
+        : SharedImage(width, height, 0, height) {
+
+        // Nothing.
+    }
+
+    /**
+     * Hold only "rowCount" rows of the width by height image, starting at
+     * "firstRow", which must be a multiple of Image::TILE_SIZE.
+     */
+    SharedImage(int width, int height, int firstRow, int rowCount)
+        : mWidth(width), mHeight(height), mFirstRow(firstRow), mRowCount(rowCount) {
+
+        for (int y = 0; y < rowCount; y += BAND_HEIGHT) {
+            // Last band may be short.
+            int bandHeight = rowCount - y < BAND_HEIGHT ? rowCount - y : BAND_HEIGHT;
+            mBands.emplace_back(std::make_unique<Band>(width, bandHeight));
+        }
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    /**
+     * Approximate number of bytes used by the accumulated values.
+     */
+    uint64_t getByteCount() const {
+        uint64_t byteCount = 0;
+
+        for (auto const &band : mBands) {
+            byteCount += band->image.getByteCount();
+        }
+
+        return byteCount;
+    }
+
+    /**
+     * Returns whether the pixel (x, y) is within the rows we hold.
+     */
+    bool isInBounds(int x, int y) const {
+        return x >= 0 && y >= mFirstRow && x < mWidth && y < mFirstRow + mRowCount;
+    }
+
+    /**
+     * Add some color to a pixel. Safe to call from any thread.
+     */
+    void touchPixel(int x, int y, linear_color red, linear_color green, linear_color blue) {
+        y -= mFirstRow;
+        Band &band = *mBands[y/BAND_HEIGHT];
+
+        std::lock_guard<std::mutex> lock(band.mutex);
+        band.image.touchPixel(x, y % BAND_HEIGHT, red, green, blue);
+    }
+
+    /**
+     * Add a batch of colors to their pixels, taking each band's lock once
+     * for a run of splats in that band. Safe to call from any thread.
+     */
+    void touchPixels(const Splat *splats, int count) {
+        int i = 0;
+
+        while (i < count) {
+            int bandIndex = (splats[i].y - mFirstRow)/BAND_HEIGHT;
+            Band &band = *mBands[bandIndex];
+            int firstRow = mFirstRow + bandIndex*BAND_HEIGHT;
+
+            std::lock_guard<std::mutex> lock(band.mutex);
+            for (; i < count && (splats[i].y - mFirstRow)/BAND_HEIGHT == bandIndex; i++) {
+                const Splat &splat = splats[i];
+                band.image.touchPixel(splat.x, splat.y - firstRow,
+                        splat.red, splat.green, splat.blue);
+            }
+        }
+    }
+
+    /**
+     * Add our image data to the image, whose first row is row "imageFirstRow"
+     * of ours. Safe to call while other threads are touching pixels.
+     */
+    void addTo(Image &image, int imageFirstRow = 0) {
+        for (unsigned i = 0; i < mBands.size(); i++) {
+            Band &band = *mBands[i];
+
+            std::lock_guard<std::mutex> lock(band.mutex);
+            image.addRows(band.image, mFirstRow + i*BAND_HEIGHT - imageFirstRow);
+        }
+    }
+};
+
+#endif // SHARED_IMAGE_H
@@ -0,0 +1,173 @@
+#ifndef SNAPSHOT_IMAGE_H
+#define SNAPSHOT_IMAGE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Image.h"
+#include "RenderState.h"
+#include "Splat.h"
+#include "util.h"
+
+/**
+ * Per-thread image that can be previewed or checkpointed while the thread
+ * renders into it. The thread accumulates into a private delta image, and
+ * every so often publishes it through an atomic slot, along with where its
+ * orbit was at that point, and starts a new one. The viewer takes published
+ * deltas from the slot, adds them to its running total, and hands the
+ * emptied images back for reuse. Neither side ever reads an image the other
+ * is writing, and the viewer only sums what's new.
+ *
+ * The deltas are Images, or PaletteImages for recoloring the preview, or
+ * any image with touchPixel() and clear().
+ */
+template <typename IMAGE>
+class SnapshotImage {
+public:
+    // Points accumulated since the previous delta, and the render state
+    // after the last of them.
+    struct Delta {
+        IMAGE image;
+        RenderState state;
+
+        Delta(int width, int height)
+            : image(width, height) {
+
+            // Nothing.
+        }
+    };
+
+private:
+    int mWidth;
+    int mHeight;
+    // Only used by the render thread until it finishes.
+    std::unique_ptr<Delta> mDelta;
+    // Delta waiting for the viewer, or null. Only the render thread sets it
+    // and only the viewer clears it.
+    std::atomic<Delta *> mPublished;
+    // Emptied delta handed back by the viewer, or null.
+    std::atomic<Delta *> mSpare;
+
+public:
+    SnapshotImage(int width, int height)
+        : mWidth(width), mHeight(height), mDelta(std::make_unique<Delta>(width, height)),
+        mPublished(nullptr), mSpare(nullptr) {
+
+        // Nothing.
+    }
+
+    ~SnapshotImage() {
+        delete mPublished.load();
+        delete mSpare.load();
+    }
+
+    int getWidth() const {
+        return mWidth;
+    }
+
+    int getHeight() const {
+        return mHeight;
+    }
+
+    uint64_t getByteCount() const {
+        uint64_t byteCount = mDelta->image.getByteCount();
+
+        Delta *published = mPublished.load();
+        if (published != nullptr) {
+            byteCount += published->image.getByteCount();
+        }
+
+        return byteCount;
+    }
+
+    /**
+     * Returns whether the pixel (x, y) is within the image.
+     */
+    bool isInBounds(int x, int y) const {
+        return x >= 0 && y >= 0 && x < mWidth && y < mHeight;
+    }
+
+    /**
+     * Add a point to a pixel, with the arguments of the image's
+     * touchPixel(). Render thread only.
+     */
+    template <typename... ARGS>
+    void touchPixel(int x, int y, ARGS... args) {
+        mDelta->image.touchPixel(x, y, args...);
+    }
+
+    /**
+     * Add a batch of colors to their pixels. Render thread only.
+     */
+    void touchPixels(const Splat *splats, int count) {
+        mDelta->image.touchPixels(splats, count);
+    }
+
+    /**
+     * Publish the delta with the state of the render after its last point,
+     * if the viewer has taken the previous one. Otherwise keep accumulating
+     * into it, so the render thread never waits. Render thread only.
+     */
+    void publish(RenderState const &state) {
+        if (mPublished.load(std::memory_order_relaxed) != nullptr) {
+            return;
+        }
+
+        Delta *next = mSpare.exchange(nullptr, std::memory_order_acquire);
+        if (next == nullptr) {
+            next = new Delta(mWidth, mHeight);
+        }
+
+        mDelta->state = state;
+        mPublished.store(mDelta.release(), std::memory_order_release);
+        mDelta.reset(next);
+    }
+
+    /**
+     * Record the state of the render when it finishes, for the delta that
+     * wasn't published. Render thread only.
+     */
+    void finish(RenderState const &state) {
+        mDelta->state = state;
+    }
+
+    /**
+     * Take the published delta, if any, returning null if the render thread
+     * hasn't published one since the last call. Viewer only. Give it back
+     * with giveBack() when done with it.
+     */
+    const Delta *takeDelta() {
+        return mPublished.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    /**
+     * Empty a delta returned by takeDelta() and hand it back to the render
+     * thread for reuse.
+     */
+    void giveBack(const Delta *delta) {
+        Delta *emptied = const_cast<Delta *>(delta);
+        emptied->image.clear();
+
+        delete mSpare.exchange(emptied, std::memory_order_release);
+    }
+
+    /**
+     * The deltas that the viewer hasn't taken, oldest first, so the last
+     * one has the state at the end of the render. Only call after the render
+     * thread has finished.
+     */
+    std::vector<const Delta *> getPending() const {
+        std::vector<const Delta *> pending;
+
+        Delta *published = mPublished.load();
+        if (published != nullptr) {
+            pending.push_back(published);
+        }
+        pending.push_back(mDelta.get());
+
+        return pending;
+    }
+};
+
+#endif // SNAPSHOT_IMAGE_H
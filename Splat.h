@@ -0,0 +1,17 @@
+#ifndef SPLAT_H
+#define SPLAT_H
+
+#include "util.h"
+
+/**
+ * Color to be added to a pixel.
+ */
+struct Splat {
+    int x;
+    int y;
+    linear_color red;
+    linear_color green;
+    linear_color blue;
+};
+
+#endif // SPLAT_H
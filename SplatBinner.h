@@ -0,0 +1,189 @@
+#ifndef SPLAT_BINNER_H
+#define SPLAT_BINNER_H
+
+#include <cstdint>
+#include <vector>
+#include "Image.h"
+#include "Splat.h"
+#include "util.h"
+
+/**
+ * Per-thread staging layer between the renderer and an image (Image or
+ * SharedImage). Rather than touching random pixels across the whole image,
+ * splats are appended to a small bin for their window of tiles, and a full
+ * bin is flushed to the image all at once.
+ *
+ * A window is a few adjacent tiles in one row of tiles, which are next to
+ * each other in memory and in one of SharedImage's bands, so a flush takes
+ * a single lock. Windows are a single tile when there are few enough tiles,
+ * and otherwise are widened so that there are at most MAX_BINS bins, which
+ * then take at most 2 MB. A flush touches at most 1/MAX_BINS of the image:
+ * a single 16 kB tile up to 2K, 64 kB at 4K, and 1 MB at 16K, where the
+ * image is too large for any scheme to keep the flushes in L2.
+ */
+template <typename ACCUMULATOR>
+class SplatBinner {
+    // Splats per bin, 512 bytes each.
+    static const int BIN_CAPACITY = 32;
+    static const int MAX_BINS = 4096;
+    static const int TILE_SHIFT = 5;
+    static_assert(1 << TILE_SHIFT == Image::TILE_SIZE, "TILE_SHIFT must match Image");
+    // A 64-byte cache line holds four adjacent 16-byte pixels.
+    static const int LINE_SHIFT = 2;
+
+    ACCUMULATOR &mAccumulator;
+    // Log2 of the width of a window in pixels.
+    int mWindowShift;
+    int mWindowsAcross;
+    // Bins laid end to end, BIN_CAPACITY splats each.
+    std::vector<Splat> mSplats;
+    // Number of splats in each bin.
+    std::vector<int> mCounts;
+    // One bit per cache line of a window, for finding line hits during a
+    // flush. Clear between flushes.
+    std::vector<uint64_t> mTouchedLines;
+    uint64_t mSplatCount;
+    uint64_t mFlushCount;
+    uint64_t mLineHitCount;
+
+public:
+    SplatBinner(ACCUMULATOR &accumulator)
+        : mAccumulator(accumulator), mWindowShift(TILE_SHIFT),
+        mSplatCount(0), mFlushCount(0), mLineHitCount(0) {
+
+        int width = accumulator.getWidth();
+        int bandCount = (accumulator.getHeight() + Image::TILE_SIZE - 1) >> TILE_SHIFT;
+
+        // Widen the windows until there are few enough of them.
+        while ((uint64_t) bandCount*getWindowsAcross(width) > MAX_BINS &&
+                (1 << mWindowShift) < width) {
+
+            mWindowShift++;
+        }
+        mWindowsAcross = getWindowsAcross(width);
+
+        mCounts.resize((uint64_t) bandCount*mWindowsAcross);
+        mSplats.resize(mCounts.size()*BIN_CAPACITY);
+        mTouchedLines.resize(((Image::TILE_SIZE << (mWindowShift - LINE_SHIFT)) + 63)/64);
+    }
+
+    ~SplatBinner() {
+        flush();
+    }
+
+    ACCUMULATOR &getAccumulator() {
+        return mAccumulator;
+    }
+
+    int getWidth() const {
+        return mAccumulator.getWidth();
+    }
+
+    int getHeight() const {
+        return mAccumulator.getHeight();
+    }
+
+    /**
+     * Returns whether the pixel (x, y) is within the image.
+     */
+    bool isInBounds(int x, int y) const {
+        return mAccumulator.isInBounds(x, y);
+    }
+
+    /**
+     * Queue some color to be added to a pixel.
+     */
+    void touchPixel(int x, int y, linear_color red, linear_color green, linear_color blue) {
+        int bin = (y >> TILE_SHIFT)*mWindowsAcross + (x >> mWindowShift);
+        int &count = mCounts[bin];
+
+        Splat &splat = mSplats[bin*BIN_CAPACITY + count];
+        splat.x = x;
+        splat.y = y;
+        splat.red = red;
+        splat.green = green;
+        splat.blue = blue;
+
+        count++;
+        if (count == BIN_CAPACITY) {
+            flushBin(bin);
+        }
+    }
+
+    /**
+     * Flush all queued splats to the image.
+     */
+    void flush() {
+        for (unsigned bin = 0; bin < mCounts.size(); bin++) {
+            if (mCounts[bin] > 0) {
+                flushBin(bin);
+            }
+        }
+    }
+
+    /**
+     * Number of splats flushed so far.
+     */
+    uint64_t getSplatCount() const {
+        return mSplatCount;
+    }
+
+    /**
+     * Number of flushes so far.
+     */
+    uint64_t getFlushCount() const {
+        return mFlushCount;
+    }
+
+    /**
+     * Number of splats flushed so far that landed in a cache line that an
+     * earlier splat of the same flush had touched, and so was still in L1.
+     */
+    uint64_t getLineHitCount() const {
+        return mLineHitCount;
+    }
+
+private:
+    /**
+     * The cache line of the splat's pixel within its window, numbered across
+     * each row of the window.
+     */
+    int getLine(Splat const &splat) const {
+        int windowMask = (1 << mWindowShift) - 1;
+
+        return ((splat.y & (Image::TILE_SIZE - 1)) << (mWindowShift - LINE_SHIFT)) |
+            ((splat.x & windowMask) >> LINE_SHIFT);
+    }
+
+    int getWindowsAcross(int width) const {
+        return (width + (1 << mWindowShift) - 1) >> mWindowShift;
+    }
+
+    void flushBin(int bin) {
+        int &count = mCounts[bin];
+        const Splat *splats = &mSplats[bin*BIN_CAPACITY];
+
+        // All splats of a bin are in one window, so the line within the
+        // window is enough to tell them apart.
+        for (int i = 0; i < count; i++) {
+            int line = getLine(splats[i]);
+            uint64_t &word = mTouchedLines[line >> 6];
+            uint64_t bit = (uint64_t) 1 << (line & 63);
+
+            if ((word & bit) != 0) {
+                mLineHitCount++;
+            }
+            word |= bit;
+        }
+        for (int i = 0; i < count; i++) {
+            mTouchedLines[getLine(splats[i]) >> 6] = 0;
+        }
+
+        mAccumulator.touchPixels(splats, count);
+        mSplatCount += count;
+        mFlushCount++;
+        count = 0;
+    }
+};
+
+#endif // SPLAT_BINNER_H
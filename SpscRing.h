@@ -0,0 +1,83 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Lock-free fixed-size queue for exactly one producer thread and one
+ * consumer thread.
+ */
+template <typename T>
+class SpscRing {
+    std::vector<T> mSlots;
+    uint64_t mMask;
+
+    // Written by the consumer. Padded so that the consumer's and producer's
+    // fields don't share a cache line.
+    char mPad0[64];
+    std::atomic<uint64_t> mHead;
+    // Consumer's copy of mTail.
+    uint64_t mCachedTail;
+
+    // Written by the producer.
+    char mPad1[64];
+    std::atomic<uint64_t> mTail;
+    // Producer's copy of mHead.
+    uint64_t mCachedHead;
+    char mPad2[64];
+
+public:
+    // The capacity must be a power of two.
+    SpscRing(int capacity)
+        : mSlots(capacity), mMask(capacity - 1),
+        mHead(0), mCachedTail(0), mTail(0), mCachedHead(0) {
+
+        // Nothing.
+    }
+
+    /**
+     * Add a value to the queue. Returns false if the queue is full. Must
+     * only be called by the producer.
+     */
+    bool push(T const &value) {
+        uint64_t tail = mTail.load(std::memory_order_relaxed);
+
+        if (tail - mCachedHead == mSlots.size()) {
+            // Looks full, see how far the consumer has got.
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if (tail - mCachedHead == mSlots.size()) {
+                return false;
+            }
+        }
+
+        mSlots[tail & mMask] = value;
+        mTail.store(tail + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * Remove all queued values, calling "f" on each. Returns the number
+     * of values. Must only be called by the consumer.
+     */
+    template <typename FUNC>
+    int popAll(FUNC f) {
+        uint64_t head = mHead.load(std::memory_order_relaxed);
+
+        if (head == mCachedTail) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+        }
+
+        int count = (int) (mCachedTail - head);
+        for (; head != mCachedTail; head++) {
+            f(mSlots[head & mMask]);
+        }
+        mHead.store(head, std::memory_order_release);
+
+        return count;
+    }
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,463 @@
+#ifndef TONE_MAPPER_H
+#define TONE_MAPPER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include "Image.h"
+#include "PngWriter.h"
+#include "util.h"
+
+/**
+ * Turns accumulated counts and color sums into 8-bit pixels without
+ * modifying the image, so that a finished render can be exposed again with
+ * different settings. Like Image::brightenDarks(), each pixel is scaled by
+ * log(1 + count)/count and normalized by the largest component, then gamma
+ * corrected. The log and gamma curves are in tables, and bands of rows are
+ * converted in parallel. Images are anything with getWidth(), getHeight()
+ * and readRow(), such as Image and BandedImage.
+ */
+class ToneMapper {
+public:
+    struct Settings {
+        // Multiplies the normalized image; brighter parts clip to white.
+        double exposure = 1;
+        double gamma = 2;
+        // From 0, gamma correcting each component, which washes out
+        // saturated colors, to 1, gamma correcting the brightest component
+        // and scaling the others like it, which keeps their hue.
+        double vibrancy = 0;
+    };
+
+private:
+    // Counts below this have their brightening multiplier in a table.
+    static const int LOG_TABLE_SIZE = 4096;
+    // Entries in the gamma table, over normalized values from 0 to 1.
+    static const int GAMMA_TABLE_SIZE = 65536;
+
+    Settings mSettings;
+    std::vector<float> mLogTable;
+    // Gamma corrected values from 0 to 255.99, before truncating.
+    std::vector<float> mGammaTable;
+
+public:
+    ToneMapper(Settings const &settings)
+        : mSettings(settings), mLogTable(LOG_TABLE_SIZE), mGammaTable(GAMMA_TABLE_SIZE) {
+
+        mLogTable[0] = 0;
+        for (int count = 1; count < LOG_TABLE_SIZE; count++) {
+            mLogTable[count] = log(1.0 + count)/count;
+        }
+        for (int i = 0; i < GAMMA_TABLE_SIZE; i++) {
+            mGammaTable[i] = 255.99*pow((double) i/(GAMMA_TABLE_SIZE - 1), 1/settings.gamma);
+        }
+    }
+
+    /**
+     * Convert the image, which must not have been brightened, to RGB with
+     * "threadCount" threads. "max" is the image's largest component after
+     * brightening, if known from Image::addAll(), or 0 to find it.
+     */
+    template <typename IMAGE>
+    void toRgb(const IMAGE &image, std::vector<gamma_color> &rgb, int threadCount,
+            double max = 0) const {
+
+        convert(image, rgb, false, threadCount, max);
+    }
+
+    /**
+     * Like toRgb(), but to BGRA for the preview window.
+     */
+    template <typename IMAGE>
+    void toBgra(const IMAGE &image, std::vector<gamma_color> &bgra, int threadCount,
+            double max = 0) const {
+
+        convert(image, bgra, true, threadCount, max);
+    }
+
+    /**
+     * Convert the image, which must not have been brightened, and save it
+     * to the pathname as a PNG file, returning whether successful. "max" is
+     * as for toRgb().
+     */
+    template <typename IMAGE>
+    bool save(const IMAGE &image, const std::string &pathname, int threadCount,
+            double max = 0) const {
+
+        int width = image.getWidth();
+        int height = image.getHeight();
+        float invMax = getInvMax(image, threadCount, max);
+
+        PngWriter writer(threadCount);
+        if (!writer.open(pathname, width, height)) {
+            return false;
+        }
+
+        // Convert a few strips at a time and stream them to the writer.
+        int rowsPerWrite = writer.getRowsPerWrite();
+        std::vector<gamma_color> rgb;
+        for (int firstRow = 0; firstRow < height; firstRow += rowsPerWrite) {
+            int rowCount = std::min(rowsPerWrite, height - firstRow);
+
+            rgb.resize((uint64_t) width*rowCount*3);
+            mapRowsInParallel(image, firstRow, rowCount, invMax, &rgb[0], false, threadCount);
+            if (!writer.writeRows(&rgb[0], rowCount)) {
+                return false;
+            }
+        }
+
+        return writer.close();
+    }
+
+    /**
+     * Like save(), but for a layer of the "whole" image, a part of its
+     * points: each pixel is brightened by the count of the same pixel in
+     * "whole" and normalized by its "max", as for toRgb(), so that the
+     * layers add up to the whole image before gamma correction.
+     */
+    template <typename IMAGE>
+    bool saveLayer(const IMAGE &layer, const IMAGE &whole, const std::string &pathname,
+            int threadCount, double max = 0) const {
+
+        if (max == 0) {
+            max = getMax(whole, threadCount);
+        }
+
+        return save(LayerRows<IMAGE>(layer, whole), pathname, threadCount, max);
+    }
+
+    /**
+     * Brighten the image, which must not have been brightened, to linear RGB
+     * scaled so that the largest component is the exposure, without gamma
+     * correcting or clipping, for HDR files. "max" is as for toRgb().
+     */
+    template <typename IMAGE>
+    void toLinear(const IMAGE &image, std::vector<float> &rgb, int threadCount,
+            double max = 0) const {
+
+        float invMax = getInvMax(image, threadCount, max);
+        int width = image.getWidth();
+        int height = image.getHeight();
+        int bandHeight = (height + threadCount - 1)/threadCount;
+
+        rgb.resize((uint64_t) width*height*3);
+        std::vector<std::thread> threads;
+        for (int firstRow = 0; firstRow < height; firstRow += bandHeight) {
+            threads.emplace_back([&, firstRow]() {
+                std::vector<uint64_t> row((uint64_t) width*4);
+
+                for (int y = firstRow; y < std::min(firstRow + bandHeight, height); y++) {
+                    image.readRow(y, &row[0]);
+
+                    for (int x = 0; x < width; x++) {
+                        const uint64_t *pixel = &row[x*4];
+                        float mult = getMultiplier(pixel[3])*invMax;
+
+                        for (int c = 0; c < 3; c++) {
+                            rgb[((uint64_t) y*width + x)*3 + c] = pixel[c]*mult;
+                        }
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Save already brightened linear RGB, such as from filtering an image,
+     * to the pathname as a PNG file, returning whether successful. The RGB
+     * is made a strip of rows at a time by makeRows(firstRow, rowCount, rgb),
+     * which returns the strip's largest component. Each strip is made once
+     * to find the largest component of all, then again to be converted and
+     * encoded while the next one is made, so there's never a full-size copy.
+     */
+    template <typename MAKE_ROWS>
+    bool saveLinear(int width, int height, MAKE_ROWS const &makeRows,
+            const std::string &pathname, int threadCount) const {
+
+        PngWriter writer(threadCount);
+        if (!writer.open(pathname, width, height)) {
+            return false;
+        }
+
+        int rowsPerWrite = writer.getRowsPerWrite();
+        std::vector<float> linear[2];
+        float max = 0;
+        for (int firstRow = 0; firstRow < height; firstRow += rowsPerWrite) {
+            int rowCount = std::min(rowsPerWrite, height - firstRow);
+
+            linear[0].resize((uint64_t) width*rowCount*3);
+            max = std::max(max, makeRows(firstRow, rowCount, &linear[0][0]));
+        }
+        float invMax = max == 0 ? 0 : mSettings.exposure/max;
+
+        // A single strip is still in the first buffer.
+        bool remake = height > rowsPerWrite;
+        std::vector<gamma_color> rgb;
+        std::thread encoder;
+        bool success = true;
+        for (int firstRow = 0, buffer = 0; firstRow < height;
+                firstRow += rowsPerWrite, buffer ^= 1) {
+
+            int rowCount = std::min(rowsPerWrite, height - firstRow);
+            if (remake) {
+                linear[buffer].resize((uint64_t) width*rowCount*3);
+                makeRows(firstRow, rowCount, &linear[buffer][0]);
+            }
+
+            if (encoder.joinable()) {
+                encoder.join();
+            }
+            if (!success) {
+                break;
+            }
+            encoder = std::thread([&, buffer, rowCount]() {
+                std::vector<float> const &strip = linear[buffer];
+
+                rgb.resize(strip.size());
+                for (uint64_t i = 0; i < strip.size(); i += 3) {
+                    mapPixel(strip[i]*invMax, strip[i + 1]*invMax, strip[i + 2]*invMax, &rgb[i]);
+                }
+                success = writer.writeRows(&rgb[0], rowCount);
+            });
+        }
+        if (encoder.joinable()) {
+            encoder.join();
+        }
+
+        return success && writer.close();
+    }
+
+    /**
+     * The image's largest component after brightening, found with
+     * "threadCount" threads, to pass as "max" when converting it in parts.
+     */
+    template <typename IMAGE>
+    double getMax(const IMAGE &image, int threadCount) const {
+        int height = image.getHeight();
+        int bandHeight = (height + threadCount - 1)/threadCount;
+        int bandCount = (height + bandHeight - 1)/bandHeight;
+        std::vector<float> maxes(bandCount);
+        std::vector<std::thread> threads;
+
+        for (int band = 0; band < bandCount; band++) {
+            threads.emplace_back(&ToneMapper::findMax<IMAGE>, this, std::cref(image),
+                    band*bandHeight, bandHeight, std::ref(maxes[band]));
+        }
+
+        double max = 0;
+        for (int band = 0; band < bandCount; band++) {
+            threads[band].join();
+            max = std::max(max, (double) maxes[band]);
+        }
+
+        return max;
+    }
+
+    /**
+     * Convert the "width" by "height" pixels of the image from ("left",
+     * "top") to RGB on the calling thread. "max" is from getMax().
+     */
+    template <typename IMAGE>
+    void toRgb(const IMAGE &image, int left, int top, int width, int height, double max,
+            std::vector<gamma_color> &rgb) const {
+
+        float invMax = max == 0 ? 0 : mSettings.exposure/max;
+
+        rgb.resize((uint64_t) width*height*3);
+        mapRect(image, left, top, width, height, invMax, &rgb[0], false);
+    }
+
+private:
+    /**
+     * The rows of a layer with the counts of the whole image, so that the
+     * layer is brightened like the whole image.
+     */
+    template <typename IMAGE>
+    class LayerRows {
+        const IMAGE &mLayer;
+        const IMAGE &mWhole;
+
+    public:
+        LayerRows(const IMAGE &layer, const IMAGE &whole)
+            : mLayer(layer), mWhole(whole) {
+
+            // Nothing.
+        }
+
+        int getWidth() const {
+            return mLayer.getWidth();
+        }
+
+        int getHeight() const {
+            return mLayer.getHeight();
+        }
+
+        void readRow(int y, uint64_t *values) const {
+            readRow(y, 0, mLayer.getWidth(), values);
+        }
+
+        void readRow(int y, int left, int count, uint64_t *values) const {
+            std::vector<uint64_t> whole((uint64_t) count*4);
+
+            mLayer.readRow(y, left, count, values);
+            mWhole.readRow(y, left, count, &whole[0]);
+            for (int x = 0; x < count; x++) {
+                values[x*4 + 3] = whole[x*4 + 3];
+            }
+        }
+    };
+
+    /**
+     * Brightening multiplier of a pixel with "count" points.
+     */
+    float getMultiplier(uint64_t count) const {
+        return count < LOG_TABLE_SIZE ? mLogTable[count] : log(1.0 + count)/count;
+    }
+
+    /**
+     * Gamma correct a normalized pixel into "out" as red, green and blue.
+     */
+    void mapPixel(float red, float green, float blue, gamma_color *out) const {
+        float value[3] = { red, green, blue };
+        float brightest = std::max(red, std::max(green, blue));
+        float vibrancy = mSettings.vibrancy;
+
+        // Scale for the components when gamma correcting the brightest.
+        float scale = brightest > 0 ? lookUpGamma(brightest)/brightest : 0;
+
+        for (int c = 0; c < 3; c++) {
+            float mapped = (1 - vibrancy)*lookUpGamma(value[c]) + vibrancy*value[c]*scale;
+            out[c] = (int) std::min(mapped, 255.0f);
+        }
+    }
+
+    float lookUpGamma(float value) const {
+        return mGammaTable[(int) (std::min(value, 1.0f)*(GAMMA_TABLE_SIZE - 1))];
+    }
+
+    /**
+     * Convert the image to RGB or BGRA in parallel bands of rows, finding
+     * the largest brightened component first if "max" is 0.
+     */
+    template <typename IMAGE>
+    void convert(const IMAGE &image, std::vector<gamma_color> &out, bool bgra,
+            int threadCount, double max) const {
+
+        float invMax = getInvMax(image, threadCount, max);
+
+        out.resize((uint64_t) image.getWidth()*image.getHeight()*(bgra ? 4 : 3));
+        mapRowsInParallel(image, 0, image.getHeight(), invMax, &out[0], bgra, threadCount);
+    }
+
+    /**
+     * The multiplier for brightened components, finding the largest one if
+     * "max" is 0.
+     */
+    template <typename IMAGE>
+    float getInvMax(const IMAGE &image, int threadCount, double max) const {
+        if (max == 0) {
+            max = getMax(image, threadCount);
+        }
+
+        return max == 0 ? 0 : mSettings.exposure/max;
+    }
+
+    /**
+     * Convert "rowCount" rows starting at "firstRow" into "out" in parallel
+     * bands.
+     */
+    template <typename IMAGE>
+    void mapRowsInParallel(const IMAGE &image, int firstRow, int rowCount, float invMax,
+            gamma_color *out, bool bgra, int threadCount) const {
+
+        int bandHeight = (rowCount + threadCount - 1)/threadCount;
+        uint64_t bandSize = (uint64_t) bandHeight*image.getWidth()*(bgra ? 4 : 3);
+        std::vector<std::thread> threads;
+
+        for (int band = 0; band*bandHeight < rowCount; band++) {
+            threads.emplace_back(&ToneMapper::mapRows<IMAGE>, this, std::cref(image),
+                    firstRow + band*bandHeight, std::min(bandHeight, rowCount - band*bandHeight),
+                    invMax, out + band*bandSize, bgra);
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Set "max" to the largest brightened component of "rowCount" rows
+     * starting at "firstRow".
+     */
+    template <typename IMAGE>
+    void findMax(const IMAGE &image, int firstRow, int rowCount, float &max) const {
+        int width = image.getWidth();
+        rowCount = std::min(rowCount, image.getHeight() - firstRow);
+        std::vector<uint64_t> row((uint64_t) width*4);
+
+        max = 0;
+        for (int y = firstRow; y < firstRow + rowCount; y++) {
+            image.readRow(y, &row[0]);
+
+            for (int x = 0; x < width; x++) {
+                const uint64_t *pixel = &row[x*4];
+                uint64_t component = std::max(pixel[0], std::max(pixel[1], pixel[2]));
+
+                if (component > 0) {
+                    max = std::max(max, component*getMultiplier(pixel[3]));
+                }
+            }
+        }
+    }
+
+    /**
+     * Convert "rowCount" rows starting at "firstRow" into "out",
+     * multiplying the brightened components by "invMax".
+     */
+    template <typename IMAGE>
+    void mapRows(const IMAGE &image, int firstRow, int rowCount, float invMax,
+            gamma_color *out, bool bgra) const {
+
+        mapRect(image, 0, firstRow, image.getWidth(), rowCount, invMax, out, bgra);
+    }
+
+    /**
+     * Like mapRows(), but only the "width" pixels of each row from "left".
+     */
+    template <typename IMAGE>
+    void mapRect(const IMAGE &image, int left, int firstRow, int width, int rowCount,
+            float invMax, gamma_color *out, bool bgra) const {
+
+        int channels = bgra ? 4 : 3;
+        std::vector<uint64_t> row((uint64_t) width*4);
+
+        for (int y = 0; y < rowCount; y++) {
+            image.readRow(firstRow + y, left, width, &row[0]);
+
+            for (int x = 0; x < width; x++) {
+                const uint64_t *pixel = &row[x*4];
+                gamma_color *outPixel = &out[((uint64_t) y*width + x)*channels];
+                float mult = getMultiplier(pixel[3])*invMax;
+
+                if (bgra) {
+                    gamma_color rgb[3];
+                    mapPixel(pixel[0]*mult, pixel[1]*mult, pixel[2]*mult, rgb);
+                    outPixel[0] = rgb[2];
+                    outPixel[1] = rgb[1];
+                    outPixel[2] = rgb[0];
+                    outPixel[3] = 255;
+                } else {
+                    mapPixel(pixel[0]*mult, pixel[1]*mult, pixel[2]*mult, outPixel);
+                }
+            }
+        }
+    }
+};
+
+#endif // TONE_MAPPER_H
@@ -37,6 +37,32 @@ public:
         x = new_x;
         y = new_y;
     }
+
+    /**
+     * Get the matrix as { a, b, c, d, e, f }.
+     */
+    void getMatrix(double matrix[6]) const {
+        matrix[0] = a;
+        matrix[1] = b;
+        matrix[2] = c;
+        matrix[3] = d;
+        matrix[4] = e;
+        matrix[5] = f;
+    }
+
+    virtual std::unique_ptr<Attractor> interpolate(Attractor const &other, double t) const {
+        auto o = dynamic_cast<TransformAttractor const *>(&other);
+        if (o == nullptr) {
+            return nullptr;
+        }
+
+        auto attractor = std::make_unique<TransformAttractor>(
+                lerp(a, o->a, t), lerp(b, o->b, t), lerp(c, o->c, t),
+                lerp(d, o->d, t), lerp(e, o->e, t), lerp(f, o->f, t));
+        attractor->interpolateCommon(*this, *o, t);
+
+        return attractor;
+    }
 };
 
 #endif // TRANSFORM_ATTRACTOR_H
@@ -1,6 +1,7 @@
 #ifndef VARIATIONS_H
 #define VARIATIONS_H
 
+#include <memory>
 #include <math.h>
 
 /**
@@ -27,6 +28,36 @@ public:
             >> this->e >> this->f >> this->g;
     }
 
+    /**
+     * Make a new set of variations whose coefficients are "t" (0 to 1) of the way
+     * from ours to "other"'s.
+     */
+    std::unique_ptr<Variations> interpolate(Variations const &other, double t) const {
+        return std::make_unique<Variations>(
+                a + (other.a - a)*t,
+                b + (other.b - b)*t,
+                c + (other.c - c)*t,
+                d + (other.d - d)*t,
+                e + (other.e - e)*t,
+                f + (other.f - f)*t,
+                g + (other.g - g)*t);
+    }
+
+    /**
+     * Whether only the linear variation is used, so that transform() just
+     * scales the point by getLinearWeight().
+     */
+    bool isLinear() const {
+        return b <= 0 && c <= 0 && d <= 0 && e <= 0 && f <= 0 && g <= 0;
+    }
+
+    /**
+     * Weight of the linear variation.
+     */
+    double getLinearWeight() const {
+        return a > 0 ? a : 0;
+    }
+
     /**
      * Modifies the point by a blend of a bunch of variations.
      */
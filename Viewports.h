@@ -0,0 +1,82 @@
+#ifndef VIEWPORTS_H
+#define VIEWPORTS_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "BoundingBox.h"
+#include "Image.h"
+#include "util.h"
+
+/**
+ * Several images of different parts of the attractor, such as the whole
+ * thing and a few close-ups, that are all rendered from the same orbit.
+ * Each point lands in every view that contains it.
+ */
+class Viewports {
+public:
+    // Area of the attractor and size of the image of one view.
+    struct View {
+        BoundingBox bbox;
+        int width;
+        int height;
+    };
+
+private:
+    struct Viewport {
+        View view;
+        std::unique_ptr<Image> image;
+        // Number of points that landed in the view.
+        uint64_t hitCount;
+    };
+
+    std::vector<Viewport> mViewports;
+
+public:
+    Viewports(std::vector<View> const &views) {
+        for (View const &view : views) {
+            mViewports.push_back(Viewport{ view,
+                    std::make_unique<Image>(view.width, view.height), 0 });
+        }
+    }
+
+    int getViewCount() const {
+        return mViewports.size();
+    }
+
+    Image const &getImage(int view) const {
+        return *mViewports[view].image;
+    }
+
+    uint64_t getHitCount(int view) const {
+        return mViewports[view].hitCount;
+    }
+
+    uint64_t getByteCount() const {
+        uint64_t byteCount = 0;
+
+        for (Viewport const &viewport : mViewports) {
+            byteCount += viewport.image->getByteCount();
+        }
+
+        return byteCount;
+    }
+
+    /**
+     * Add some color to the point (x, y) of the attractor in every view.
+     */
+    void touchPoint(double x, double y, linear_color red, linear_color green, linear_color blue) {
+        for (Viewport &viewport : mViewports) {
+            View const &view = viewport.view;
+            int ix = (int) (view.bbox.normalizeX(x)*(view.width - 1) + 0.5);
+            int iy = (int) ((1 - view.bbox.normalizeY(y))*(view.height - 1) + 0.5);
+
+            if (viewport.image->isInBounds(ix, iy)) {
+                viewport.image->touchPixel(ix, iy, red, green, blue);
+                viewport.hitCount++;
+            }
+        }
+    }
+};
+
+#endif // VIEWPORTS_H
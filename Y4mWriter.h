@@ -0,0 +1,127 @@
+#ifndef Y4M_WRITER_H
+#define Y4M_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "util.h"
+
+/**
+ * Writes 8-bit RGB frames as a YUV4MPEG2 stream, the uncompressed format
+ * that video encoders such as ffmpeg and x264 read from a pipe. Frames are
+ * converted to full-range BT.601 YCbCr with chroma averaged over 2x2
+ * blocks (4:2:0, centered like JPEG).
+ */
+class Y4mWriter {
+    FILE *mFile;
+    int mWidth;
+    int mHeight;
+
+public:
+    Y4mWriter()
+        : mFile(nullptr) {
+
+        // Nothing.
+    }
+
+    ~Y4mWriter() {
+        close();
+    }
+
+    /**
+     * Create the file, or use standard output if the pathname is "-", and
+     * write the stream header. Returns whether successful.
+     */
+    bool open(const std::string &pathname, int width, int height, int fps) {
+        mFile = pathname == "-" ? stdout : fopen(pathname.c_str(), "wb");
+        if (mFile == nullptr) {
+            perror(pathname.c_str());
+            return false;
+        }
+
+        mWidth = width;
+        mHeight = height;
+        fprintf(mFile, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+                width, height, fps);
+
+        return !ferror(mFile);
+    }
+
+    /**
+     * Write a frame of width*height RGB pixels, returning whether
+     * successful.
+     */
+    bool writeFrame(std::vector<gamma_color> const &rgb) {
+        int chromaWidth = (mWidth + 1)/2;
+        int chromaHeight = (mHeight + 1)/2;
+        std::vector<uint8_t> frame((uint64_t) mWidth*mHeight +
+                (uint64_t) chromaWidth*chromaHeight*2);
+        uint8_t *luma = &frame[0];
+        uint8_t *cb = luma + (uint64_t) mWidth*mHeight;
+        uint8_t *cr = cb + (uint64_t) chromaWidth*chromaHeight;
+
+        for (uint64_t i = 0; i < (uint64_t) mWidth*mHeight; i++) {
+            const gamma_color *pixel = &rgb[i*3];
+            luma[i] = toByte(0.299*pixel[0] + 0.587*pixel[1] + 0.114*pixel[2]);
+        }
+
+        for (int cy = 0; cy < chromaHeight; cy++) {
+            for (int cx = 0; cx < chromaWidth; cx++) {
+                // Average the block, which is clipped at odd edges.
+                double red = 0;
+                double green = 0;
+                double blue = 0;
+                int count = 0;
+                for (int y = cy*2; y < std::min(cy*2 + 2, mHeight); y++) {
+                    for (int x = cx*2; x < std::min(cx*2 + 2, mWidth); x++) {
+                        const gamma_color *pixel = &rgb[((uint64_t) y*mWidth + x)*3];
+                        red += pixel[0];
+                        green += pixel[1];
+                        blue += pixel[2];
+                        count++;
+                    }
+                }
+                red /= count;
+                green /= count;
+                blue /= count;
+
+                uint64_t i = (uint64_t) cy*chromaWidth + cx;
+                cb[i] = toByte(128 - 0.168736*red - 0.331264*green + 0.5*blue);
+                cr[i] = toByte(128 + 0.5*red - 0.418688*green - 0.081312*blue);
+            }
+        }
+
+        fputs("FRAME\n", mFile);
+        fwrite(&frame[0], 1, frame.size(), mFile);
+
+        return fflush(mFile) == 0 && !ferror(mFile);
+    }
+
+    /**
+     * Close the file, returning whether everything was written.
+     */
+    bool close() {
+        if (mFile == nullptr) {
+            return true;
+        }
+
+        bool success = !ferror(mFile);
+        if (mFile == stdout) {
+            success = fflush(mFile) == 0 && success;
+        } else {
+            success = fclose(mFile) == 0 && success;
+        }
+        mFile = nullptr;
+
+        return success;
+    }
+
+private:
+    static uint8_t toByte(double value) {
+        return value <= 0 ? 0 : value >= 255 ? 255 : (uint8_t) (value + 0.5);
+    }
+};
+
+#endif // Y4M_WRITER_H
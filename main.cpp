@@ -6,126 +6,1915 @@
 #include <vector>
 #include <algorithm>
 #include <thread>
+#include <atomic>
+#include <sstream>
+#include <fstream>
 #include <unistd.h>
+#include <sys/wait.h>
 #include "Image.h"
+#include "SharedImage.h"
+#include "SplatBinner.h"
+#include "BandedImage.h"
+#include "OutOfCoreImage.h"
+#include "ApproximateImage.h"
+#include "PaletteImage.h"
+#include "LayeredImage.h"
+#include "MipPyramid.h"
+#include "Viewports.h"
+#include "AddressPrefixes.h"
+#include "Downsampler.h"
+#include "DensityEstimator.h"
+#include "ToneMapper.h"
+#include "SnapshotImage.h"
+#include "RenderState.h"
+#include "AccumulationFile.h"
+#include "HdrWriter.h"
+#include "Checkpoint.h"
+#include "Y4mWriter.h"
+#include "DeepZoomWriter.h"
 #include "AttractorSet.h"
 #include "BoundingBox.h"
 #include "Variations.h"
 #include "ColorMaps.h"
 #include "Config.h"
 #include "Timer.h"
+#include "PerfCounters.h"
 
 #ifdef DISPLAY
 #include "MiniFB.h"
 #endif
 
 static const bool INTERACTIVE = true;
-static const uint64_t FEW_SECONDS_ITERATIONS = INTERACTIVE ? -1 : 250000000LL;
+static const uint64_t BATCH_ITERATIONS = 250000000LL;
+static const uint64_t FEW_SECONDS_ITERATIONS = INTERACTIVE ? -1 : BATCH_ITERATIONS;
 static const uint64_t ITERATION_UPDATE = 10000000LL;
 static const int FUSE_LENGTH = 10000;
 static const int WIDTH = 256*3;
 static const int HEIGHT = 256*3;
+static const int MOTION_BLUR_SLICES = 64;
+// Where checkpoints are written and resumed from.
+static const char *CHECKPOINT_PATHNAME = "out.checkpoint";
+// Iterations between publishing snapshots for the preview and checkpoints.
+static const uint64_t PUBLISH_ITERATIONS = 1 << 20;
+// Fraction of physical memory to use for each band in out-of-core mode.
+static const double OUT_OF_CORE_MEMORY_FRACTION = 0.25;
+static const uint64_t BENCHMARK_ITERATIONS = 20000000LL;
+static const int BENCHMARK_RESOLUTIONS[] = { 1024, 4096, 8192, 16384 };
 
-static bool g_done;
+// How render threads accumulate their points.
+enum class Accumulation {
+    // Each thread has its own full-size image, summed at the end.
+    PER_THREAD,
+    // All threads share one image with lock-striped bands.
+    SHARED,
+    // Each thread owns a band of one image and forwards points to the others.
+    BANDED,
+    // Each thread has its own approximate image of probabilistic counts.
+    APPROXIMATE,
+    // Each thread has its own image of color map positions, colored at the end.
+    PALETTE,
+    // Each thread has its own image per layer of attractors.
+    LAYERED,
+    // Each thread has its own image per viewport.
+    VIEWPORTS,
+};
 
-static BoundingBox computeBoundingBox(Config const &config) {
+static std::atomic<bool> g_done;
+static bool g_showProgress = !INTERACTIVE;
+
+// Totals across the threads of renderBinned() since resetBinStats().
+static std::atomic<uint64_t> g_binnedSplatCount;
+static std::atomic<uint64_t> g_binFlushCount;
+static std::atomic<uint64_t> g_binLineHitCount;
+
+// Configs pre-computed at evenly-spaced times across the shutter interval.
+// Has a single entry when motion blur is off.
+typedef std::vector<std::unique_ptr<Config>> TimeSlices;
+
+/**
+ * Interpolate between the configs at shutter open and close. Returns an
+ * empty list if they can't be interpolated.
+ */
+static TimeSlices makeTimeSlices(Config const &open, Config const &close) {
+    TimeSlices timeSlices;
+
+    for (int i = 0; i < MOTION_BLUR_SLICES; i++) {
+        // Sample the middle of each slice's sub-interval.
+        double t = (i + 0.5)/MOTION_BLUR_SLICES;
+
+        auto config = open.interpolate(close, t);
+        if (!config) {
+            return TimeSlices();
+        }
+        timeSlices.push_back(std::move(config));
+    }
+
+    return timeSlices;
+}
+
+/**
+ * Pick the config for a random time within the shutter interval.
+ */
+static Config const &chooseTimeSlice(TimeSlices const &timeSlices) {
+    return timeSlices.size() == 1
+        ? *timeSlices[0]
+        : *timeSlices[my_randl() % timeSlices.size()];
+}
+
+static BoundingBox computeBoundingBox(TimeSlices const &timeSlices) {
     std::cout << "Finding the bounding box..." << std::endl;
 
-    BoundingBox bbox;
+    BoundingBox bbox;
+
+    // Starting point.
+    double x = 0;
+    double y = 0;
+
+    // Find the bounding box
+    // XXX do a better job of ignoring outliers. Fuse length isn't enough.
+    const int SAMPLE_COUNT = 10000;
+    std::vector<double> x_history(SAMPLE_COUNT);
+    std::vector<double> y_history(SAMPLE_COUNT);
+    for (int i = 0; i < FUSE_LENGTH + SAMPLE_COUNT; i++) {
+        if (i >= FUSE_LENGTH) {
+            x_history[i - FUSE_LENGTH] = x;
+            y_history[i - FUSE_LENGTH] = y;
+            bbox.grow(x, y);
+        }
+
+        Config const &config = chooseTimeSlice(timeSlices);
+        Attractor const &attractor = config.attractorSet().choose();
+        attractor.transform(x, y);
+        config.variations().transform(x, y);
+    }
+
+    bbox.growBy(0.05);  // 5% larger
+    bbox.makeSquare();
+
+    std::cout << "Computed bounding box (strict): " << bbox << std::endl;
+
+    std::sort(x_history.begin(), x_history.end());
+    std::sort(y_history.begin(), y_history.end());
+
+    const double PERCENTILE = 0.1;
+    const int skip = (int) (PERCENTILE*SAMPLE_COUNT/100 + 0.5);
+    bbox = BoundingBox(x_history[skip], y_history[skip],
+            x_history[SAMPLE_COUNT - skip - 1], y_history[SAMPLE_COUNT - skip - 1]);
+    bbox.growBy(0.15);
+    bbox.makeSquare();
+    std::cout << "Computed bounding box (percentile): " << bbox << std::endl;
+
+    return bbox;
+}
+
+/**
+ * Add a point of color map entry "colorIndex" to the image. The attractor
+ * at "attractorIndex" moved the point there.
+ */
+template <typename ACCUMULATOR>
+static void touchPixel(ACCUMULATOR &image, int x, int y,
+        ColorMap const &colorMap, int colorIndex, int) {
+
+    linear_color red, green, blue;
+    colorMap.getColor(colorIndex, red, green, blue);
+    image.touchPixel(x, y, red, green, blue);
+}
+
+/**
+ * Palette images keep the entry itself, to be colored later.
+ */
+static void touchPixel(PaletteImage &image, int x, int y,
+        ColorMap const &, int colorIndex, int) {
+
+    image.touchPixel(x, y, colorIndex);
+}
+
+static void touchPixel(SnapshotImage<PaletteImage> &image, int x, int y,
+        ColorMap const &, int colorIndex, int) {
+
+    image.touchPixel(x, y, colorIndex);
+}
+
+/**
+ * Layered images put the point in the attractor's layer.
+ */
+static void touchPixel(LayeredImage &image, int x, int y,
+        ColorMap const &colorMap, int colorIndex, int attractorIndex) {
+
+    linear_color red, green, blue;
+    colorMap.getColor(colorIndex, red, green, blue);
+    image.touchPixel(x, y, attractorIndex, red, green, blue);
+}
+
+/**
+ * Map the point (x, y) of the attractor to a pixel of the image and add it
+ * there, if it's in bounds.
+ */
+template <typename ACCUMULATOR>
+static void splat(ACCUMULATOR &image, const BoundingBox &bbox, double x, double y,
+        ColorMap const &colorMap, double colorMapValue, int attractorIndex) {
+
+    // Map to pixel.
+    int ix = (int) (bbox.normalizeX(x)*(image.getWidth() - 1) + 0.5);
+    int iy = (int) ((1 - bbox.normalizeY(y))*(image.getHeight() - 1) + 0.5);
+
+    if (image.isInBounds(ix, iy)) {
+        // Look up RGB color.
+        int colorIndex = (int) (colorMapValue*255 + 0.5);
+        touchPixel(image, ix, iy, colorMap, colorIndex, attractorIndex);
+    }
+}
+
+/**
+ * Viewports map the point to each of their views themselves.
+ */
+static void splat(Viewports &viewports, const BoundingBox &, double x, double y,
+        ColorMap const &colorMap, double colorMapValue, int) {
+
+    int colorIndex = (int) (colorMapValue*255 + 0.5);
+
+    linear_color red, green, blue;
+    colorMap.getColor(colorIndex, red, green, blue);
+    viewports.touchPoint(x, y, red, green, blue);
+}
+
+/**
+ * The state of this thread's render before iteration "iteration".
+ */
+static RenderState getRenderState(uint64_t iteration, double x, double y,
+        double colorMapValue) {
+
+    RenderState state;
+    state.iteration = iteration;
+    state.x = x;
+    state.y = y;
+    state.colorMapValue = colorMapValue;
+    get_rand_state(state.random);
+
+    return state;
+}
+
+/**
+ * The state of a render that hasn't started, at the origin with color 0
+ * and its generator seeded with "seed".
+ */
+static RenderState getInitialState(int seed) {
+    // Leave this thread's generator alone.
+    unsigned short saved[3];
+    get_rand_state(saved);
+
+    init_rand(seed);
+    RenderState state;
+    get_rand_state(state.random);
+
+    set_rand_state(saved);
+    return state;
+}
+
+/**
+ * Snapshot images take the points since the last call, with the state
+ * after them. Other accumulators don't need them.
+ */
+template <typename ACCUMULATOR>
+static void publish(ACCUMULATOR &, RenderState const &) {
+    // Nothing.
+}
+
+template <typename IMAGE>
+static void publish(SnapshotImage<IMAGE> &image, RenderState const &state) {
+    image.publish(state);
+}
+
+static void publish(SplatBinner<SnapshotImage<Image>> &binner, RenderState const &state) {
+    binner.flush();
+    binner.getAccumulator().publish(state);
+}
+
+/**
+ * Like publish(), at the end of the render.
+ */
+template <typename ACCUMULATOR>
+static void finish(ACCUMULATOR &, RenderState const &) {
+    // Nothing.
+}
+
+template <typename IMAGE>
+static void finish(SnapshotImage<IMAGE> &image, RenderState const &state) {
+    image.finish(state);
+}
+
+static void finish(SplatBinner<SnapshotImage<Image>> &binner, RenderState const &state) {
+    binner.flush();
+    binner.getAccumulator().finish(state);
+}
+
+/**
+ * Run the chaos game and accumulate points into the image, which can be an
+ * Image or a SharedImage.
+ */
+template <typename ACCUMULATOR>
+static void render(ACCUMULATOR &image, TimeSlices const &timeSlices,
+        const BoundingBox &bbox, uint64_t iterationCount, int seed) {
+
+    renderFrom(image, timeSlices, bbox, iterationCount, getInitialState(seed));
+}
+
+/**
+ * Like render(), but continue an orbit from its state, up to a total of
+ * "iterationCount" iterations.
+ */
+template <typename ACCUMULATOR>
+static void renderFrom(ACCUMULATOR &image, TimeSlices const &timeSlices,
+        const BoundingBox &bbox, uint64_t iterationCount, RenderState state) {
+
+    set_rand_state(state.random);
+
+    // Color (0-1) in the color map.
+    double colorMapValue = state.colorMapValue;
+
+    // Current point.
+    double x = state.x;
+    double y = state.y;
+
+    uint64_t i;
+    for (i = state.iteration; !g_done && i < iterationCount; i++) {
+        // Each step happens at a random time while the shutter is open.
+        Config const &config = chooseTimeSlice(timeSlices);
+        int attractorIndex = config.attractorSet().chooseIndex();
+        Attractor const &attractor = config.attractorSet().get(attractorIndex);
+        attractor.transform(x, y);
+        config.variations().transform(x, y);
+
+        // Move half-way to new color value.
+        double newColorMapValue = attractor.getColorMapValue();
+        colorMapValue = (colorMapValue + newColorMapValue)/2;
+
+        if (i >= FUSE_LENGTH) {
+            splat(image, bbox, x, y, config.colorMap(), colorMapValue, attractorIndex);
+        }
+
+        if (g_showProgress && i % ITERATION_UPDATE == 0 && i != 0) {
+            std::cout << (i*100/iterationCount) << "%" << std::endl;
+        }
+
+        if ((i + 1) % PUBLISH_ITERATIONS == 0) {
+            publish(image, getRenderState(i + 1, x, y, colorMapValue));
+        }
+    }
+
+    finish(image, getRenderState(i, x, y, colorMapValue));
+}
+
+/**
+ * Like render(), but map each orbit point through a random address prefix
+ * so that it lands in the zoomed view.
+ */
+template <typename ACCUMULATOR>
+static void renderZoomed(ACCUMULATOR &image, TimeSlices const &timeSlices,
+        AddressPrefixes const &prefixes, const BoundingBox &bbox,
+        uint64_t iterationCount, int seed) {
+
+    init_rand(seed);
+
+    double colorMapValue = 0;
+    double x = 0;
+    double y = 0;
+
+    // Zooming only works without motion blur.
+    Config const &config = *timeSlices[0];
+
+    for (uint64_t i = 0; !g_done && i < iterationCount; i++) {
+        int attractorIndex = config.attractorSet().chooseIndex();
+        Attractor const &attractor = config.attractorSet().get(attractorIndex);
+        attractor.transform(x, y);
+        config.variations().transform(x, y);
+        colorMapValue = (colorMapValue + attractor.getColorMapValue())/2;
+
+        if (i >= FUSE_LENGTH) {
+            double zoomedX = x;
+            double zoomedY = y;
+            double zoomedColorMapValue = colorMapValue;
+            int zoomedAttractorIndex = prefixes.transform(zoomedX, zoomedY,
+                    zoomedColorMapValue, attractorIndex);
+
+            splat(image, bbox, zoomedX, zoomedY, config.colorMap(),
+                    zoomedColorMapValue, zoomedAttractorIndex);
+        }
+
+        if (g_showProgress && i % ITERATION_UPDATE == 0 && i != 0) {
+            std::cout << (i*100/iterationCount) << "%" << std::endl;
+        }
+
+        if ((i + 1) % PUBLISH_ITERATIONS == 0) {
+            publish(image, getRenderState(i + 1, x, y, colorMapValue));
+        }
+    }
+}
+
+/**
+ * Like render(), but stage the points in per-thread bins that are flushed
+ * to the image a band at a time.
+ */
+template <typename ACCUMULATOR>
+static void renderBinned(ACCUMULATOR &image, TimeSlices const &timeSlices,
+        const BoundingBox &bbox, uint64_t iterationCount, int seed) {
+
+    SplatBinner<ACCUMULATOR> binner(image);
+    render(binner, timeSlices, bbox, iterationCount, seed);
+    binner.flush();
+
+    g_binnedSplatCount += binner.getSplatCount();
+    g_binFlushCount += binner.getFlushCount();
+    g_binLineHitCount += binner.getLineHitCount();
+}
+
+static void resetBinStats() {
+    g_binnedSplatCount = 0;
+    g_binFlushCount = 0;
+    g_binLineHitCount = 0;
+}
+
+/**
+ * Print how often the flushes of renderBinned() hit a cache line that the
+ * same flush had already touched.
+ */
+static void printBinStats() {
+    uint64_t splatCount = g_binnedSplatCount;
+    uint64_t flushCount = g_binFlushCount;
+    uint64_t lineHitCount = g_binLineHitCount;
+
+    std::cout << "Binned " << splatCount << " points in " << flushCount
+        << " flushes, " << std::fixed << std::setprecision(1)
+        << (splatCount == 0 ? 0 : lineHitCount*100.0/splatCount)
+        << "% hitting a cache line already touched by the flush." << std::endl;
+}
+
+/**
+ * Like render(), but only touch our own band of the image and send other
+ * points to their band's thread.
+ */
+static void renderBanded(BandedImage &image, int threadIndex, TimeSlices const &timeSlices,
+        const BoundingBox &bbox, uint64_t iterationCount, int seed) {
+
+    BandedImage::Partition partition(image, threadIndex);
+    render(partition, timeSlices, bbox, iterationCount, seed);
+    partition.finish();
+}
+
+/**
+ * Render threads and the images they accumulate into, for any
+ * accumulation mode.
+ */
+struct RenderThreads {
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Image>> images;
+    std::unique_ptr<SharedImage> sharedImage;
+    std::unique_ptr<BandedImage> bandedImage;
+    std::vector<std::unique_ptr<ApproximateImage>> approximateImages;
+    std::vector<std::unique_ptr<PaletteImage>> paletteImages;
+    std::vector<std::unique_ptr<LayeredImage>> layeredImages;
+    std::vector<std::unique_ptr<Viewports>> viewports;
+    // Color map of the config, for coloring palette images.
+    ColorMap const *colorMap = nullptr;
+    // Layer of each attractor, and the number of layers, for layered images.
+    std::vector<int> attractorLayers;
+    int layerCount = 0;
+    // Views for viewports, the first being the full-size image.
+    std::vector<Viewports::View> views;
+    // Prefixes for zooming, with per-thread accumulation, or null.
+    AddressPrefixes const *zoomPrefixes = nullptr;
+    // Whether per-thread and palette images are snapshot images, for
+    // previewing and checkpointing.
+    bool snapshots = false;
+    std::vector<std::unique_ptr<SnapshotImage<Image>>> snapshotImages;
+    // Sum of the deltas taken from the snapshot images so far, and the state
+    // of each thread's render after its last delta.
+    std::unique_ptr<Image> snapshotTotal;
+    std::vector<RenderState> snapshotStates;
+    // Like snapshotImages and snapshotTotal, for previewing palette images.
+    std::vector<std::unique_ptr<SnapshotImage<PaletteImage>>> paletteSnapshotImages;
+    std::unique_ptr<PaletteImage> paletteSnapshotTotal;
+
+    /**
+     * Start "thread_count" threads rendering into a width by height image.
+     */
+    void start(Accumulation accumulation, bool binSplats, int width, int height,
+            TimeSlices const &timeSlices, const BoundingBox &bbox,
+            uint64_t iterationCount, int thread_count) {
+
+        colorMap = &timeSlices[0]->colorMap();
+
+        switch (accumulation) {
+            case Accumulation::PER_THREAD:
+                if (snapshots && !snapshotTotal) {
+                    // Unless resuming from a checkpoint.
+                    snapshotTotal = std::make_unique<Image>(width, height);
+                    for (int t = 0; t < thread_count; t++) {
+                        snapshotStates.push_back(getInitialState(random()));
+                    }
+                }
+                for (int t = 0; t < thread_count; t++) {
+                    if (snapshots && zoomPrefixes == nullptr && !binSplats) {
+                        // Start from the state, so it can be checkpointed.
+                        snapshotImages.emplace_back(
+                                std::make_unique<SnapshotImage<Image>>(width, height));
+                        threads.emplace_back(renderFrom<SnapshotImage<Image>>,
+                                std::ref(*snapshotImages.back()), std::cref(timeSlices),
+                                std::cref(bbox), iterationCount, snapshotStates[t]);
+                    } else if (snapshots) {
+                        snapshotImages.emplace_back(
+                                std::make_unique<SnapshotImage<Image>>(width, height));
+                        startPerThread(*snapshotImages.back(), binSplats, timeSlices,
+                                bbox, iterationCount);
+                    } else {
+                        images.emplace_back(std::make_unique<Image>(width, height));
+                        startPerThread(*images.back(), binSplats, timeSlices,
+                                bbox, iterationCount);
+                    }
+                }
+                break;
+
+            case Accumulation::SHARED:
+                sharedImage = std::make_unique<SharedImage>(width, height);
+                for (int t = 0; t < thread_count; t++) {
+                    threads.emplace_back(
+                            binSplats ? renderBinned<SharedImage> : render<SharedImage>,
+                            std::ref(*sharedImage),
+                            std::cref(timeSlices), std::cref(bbox),
+                            iterationCount, random());
+                }
+                break;
+
+            case Accumulation::BANDED:
+                // Points are already batched through the queues, so no binning.
+                bandedImage = std::make_unique<BandedImage>(width, height, thread_count);
+                for (int t = 0; t < thread_count; t++) {
+                    threads.emplace_back(renderBanded, std::ref(*bandedImage), t,
+                            std::cref(timeSlices), std::cref(bbox),
+                            iterationCount, random());
+                }
+                break;
+
+            case Accumulation::APPROXIMATE:
+                for (int t = 0; t < thread_count; t++) {
+                    approximateImages.emplace_back(
+                            std::make_unique<ApproximateImage>(width, height));
+                    threads.emplace_back(
+                            binSplats ? renderBinned<ApproximateImage> : render<ApproximateImage>,
+                            std::ref(*approximateImages.back()),
+                            std::cref(timeSlices), std::cref(bbox),
+                            iterationCount, random());
+                }
+                break;
+
+            case Accumulation::PALETTE:
+                // Splats carry colors, not color map entries, so no binning.
+                if (snapshots) {
+                    paletteSnapshotTotal = std::make_unique<PaletteImage>(width, height);
+                }
+                for (int t = 0; t < thread_count; t++) {
+                    if (snapshots) {
+                        paletteSnapshotImages.emplace_back(
+                                std::make_unique<SnapshotImage<PaletteImage>>(width, height));
+                        threads.emplace_back(render<SnapshotImage<PaletteImage>>,
+                                std::ref(*paletteSnapshotImages.back()),
+                                std::cref(timeSlices), std::cref(bbox),
+                                iterationCount, random());
+                    } else {
+                        paletteImages.emplace_back(
+                                std::make_unique<PaletteImage>(width, height));
+                        threads.emplace_back(render<PaletteImage>,
+                                std::ref(*paletteImages.back()),
+                                std::cref(timeSlices), std::cref(bbox),
+                                iterationCount, random());
+                    }
+                }
+                break;
+
+            case Accumulation::LAYERED:
+                // Splats don't know their attractor, so no binning.
+                for (int t = 0; t < thread_count; t++) {
+                    layeredImages.emplace_back(std::make_unique<LayeredImage>(
+                                width, height, attractorLayers, layerCount));
+                    threads.emplace_back(render<LayeredImage>,
+                            std::ref(*layeredImages.back()),
+                            std::cref(timeSlices), std::cref(bbox),
+                            iterationCount, random());
+                }
+                break;
+
+            case Accumulation::VIEWPORTS:
+                for (int t = 0; t < thread_count; t++) {
+                    viewports.emplace_back(std::make_unique<Viewports>(views));
+                    threads.emplace_back(render<Viewports>,
+                            std::ref(*viewports.back()),
+                            std::cref(timeSlices), std::cref(bbox),
+                            iterationCount, random());
+                }
+                break;
+        }
+    }
+
+    /**
+     * Start a thread rendering into its own image.
+     */
+    template <typename ACCUMULATOR>
+    void startPerThread(ACCUMULATOR &image, bool binSplats, TimeSlices const &timeSlices,
+            const BoundingBox &bbox, uint64_t iterationCount) {
+
+        if (zoomPrefixes != nullptr) {
+            threads.emplace_back(renderZoomed<ACCUMULATOR>, std::ref(image),
+                    std::cref(timeSlices), std::cref(*zoomPrefixes),
+                    std::cref(bbox), iterationCount, random());
+        } else {
+            threads.emplace_back(binSplats ? renderBinned<ACCUMULATOR> : render<ACCUMULATOR>,
+                    std::ref(image),
+                    std::cref(timeSlices), std::cref(bbox),
+                    iterationCount, random());
+        }
+    }
+
+    /**
+     * Add the deltas the snapshot images have published since the last call
+     * to snapshotTotal and paletteSnapshotTotal, while the threads are
+     * rendering. Returns whether there were any.
+     */
+    bool updateSnapshots() {
+        std::vector<SnapshotImage<Image> *> owners;
+        std::vector<const SnapshotImage<Image>::Delta *> deltas;
+        std::vector<const Image *> deltaImages;
+        for (unsigned t = 0; t < snapshotImages.size(); t++) {
+            const SnapshotImage<Image>::Delta *delta = snapshotImages[t]->takeDelta();
+            if (delta != nullptr) {
+                owners.push_back(snapshotImages[t].get());
+                deltas.push_back(delta);
+                deltaImages.push_back(&delta->image);
+                snapshotStates[t] = delta->state;
+            }
+        }
+
+        if (!deltas.empty()) {
+            snapshotTotal->addAll(deltaImages, deltaImages.size());
+        }
+        for (unsigned i = 0; i < deltas.size(); i++) {
+            owners[i]->giveBack(deltas[i]);
+        }
+
+        bool updated = !deltas.empty();
+        for (auto &paletteSnapshotImage : paletteSnapshotImages) {
+            const SnapshotImage<PaletteImage>::Delta *delta = paletteSnapshotImage->takeDelta();
+            if (delta != nullptr) {
+                paletteSnapshotTotal->add(delta->image);
+                paletteSnapshotImage->giveBack(delta);
+                updated = true;
+            }
+        }
+
+        return updated;
+    }
+
+    /**
+     * The state of each thread's render at its end, for checkpointing with
+     * the image from addTo(). Only call after join().
+     */
+    std::vector<RenderState> getFinalStates() const {
+        std::vector<RenderState> states;
+
+        for (auto const &snapshotImage : snapshotImages) {
+            states.push_back(snapshotImage->getPending().back()->state);
+        }
+
+        return states;
+    }
+
+    /**
+     * Wait for all threads to finish.
+     */
+    void join() {
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Add the data accumulated so far to the full-size image, which must be
+     * empty. Returns the image's largest component after brightening for
+     * the tone mapper, or 0 if it isn't known.
+     */
+    double addTo(Image &image) const {
+        return addTo(image, *colorMap);
+    }
+
+    /**
+     * Like addTo(), but color any palette images with another color map.
+     */
+    double addTo(Image &image, ColorMap const &paletteColorMap) const {
+        // Per-thread images are summed in parallel, one merge thread per
+        // render thread.
+        std::vector<const Image *> threadImages;
+        for (auto const &threadImage : images) {
+            threadImages.push_back(threadImage.get());
+        }
+        for (auto const &threadViewports : viewports) {
+            threadImages.push_back(&threadViewports->getImage(0));
+        }
+        if (snapshotTotal) {
+            threadImages.push_back(snapshotTotal.get());
+            for (auto const &snapshotImage : snapshotImages) {
+                for (const SnapshotImage<Image>::Delta *pending : snapshotImage->getPending()) {
+                    threadImages.push_back(&pending->image);
+                }
+            }
+        }
+        double max = threadImages.empty() ? 0 : image.addAll(threadImages, threadImages.size());
+
+        if (sharedImage) {
+            sharedImage->addTo(image);
+        }
+        for (auto const &approximateImage : approximateImages) {
+            approximateImage->addTo(image);
+        }
+        for (auto const &paletteImage : paletteImages) {
+            paletteImage->addTo(image, paletteColorMap);
+        }
+        if (paletteSnapshotTotal) {
+            // Only the deltas taken so far, for the preview.
+            paletteSnapshotTotal->addTo(image, paletteColorMap);
+        }
+        for (auto const &layeredImage : layeredImages) {
+            layeredImage->addTo(image);
+        }
+
+        // Only the per-thread images were scanned for the maximum.
+        bool onlyThreadImages = !sharedImage && approximateImages.empty() &&
+            paletteImages.empty() && !paletteSnapshotTotal && layeredImages.empty();
+
+        return onlyThreadImages ? max : 0;
+    }
+
+    /**
+     * Add the data accumulated so far in one view to an image of its size.
+     */
+    void addViewTo(Image &image, int view) const {
+        for (auto const &threadViewports : viewports) {
+            image.add(threadViewports->getImage(view));
+        }
+    }
+
+    /**
+     * Number of points that landed in the view so far.
+     */
+    uint64_t getViewHitCount(int view) const {
+        uint64_t hitCount = 0;
+
+        for (auto const &threadViewports : viewports) {
+            hitCount += threadViewports->getHitCount(view);
+        }
+
+        return hitCount;
+    }
+
+    /**
+     * Add one layer of the layered images to the full-size image.
+     */
+    void addLayerTo(Image &image, int layer) const {
+        for (auto const &layeredImage : layeredImages) {
+            image.add(layeredImage->getLayer(layer));
+        }
+    }
+
+    /**
+     * Approximate number of bytes used by the accumulated values.
+     */
+    uint64_t getByteCount() const {
+        uint64_t byteCount = 0;
+
+        for (auto const &threadImage : images) {
+            byteCount += threadImage->getByteCount();
+        }
+        if (sharedImage) {
+            byteCount += sharedImage->getByteCount();
+        }
+        if (bandedImage) {
+            byteCount += bandedImage->getByteCount();
+        }
+        for (auto const &approximateImage : approximateImages) {
+            byteCount += approximateImage->getByteCount();
+        }
+        for (auto const &paletteImage : paletteImages) {
+            byteCount += paletteImage->getByteCount();
+        }
+        for (auto const &layeredImage : layeredImages) {
+            byteCount += layeredImage->getByteCount();
+        }
+        for (auto const &threadViewports : viewports) {
+            byteCount += threadViewports->getByteCount();
+        }
+        for (auto const &snapshotImage : snapshotImages) {
+            byteCount += snapshotImage->getByteCount();
+        }
+        if (snapshotTotal) {
+            byteCount += snapshotTotal->getByteCount();
+        }
+        for (auto const &paletteSnapshotImage : paletteSnapshotImages) {
+            byteCount += paletteSnapshotImage->getByteCount();
+        }
+        if (paletteSnapshotTotal) {
+            byteCount += paletteSnapshotTotal->getByteCount();
+        }
+
+        return byteCount;
+    }
+};
+
+/**
+ * Checkpoint the render threads every "interval" seconds until "rendered"
+ * is set. The threads keep rendering while the deltas they've published
+ * are summed and written.
+ */
+static void writeCheckpoints(RenderThreads &renderThreads, std::atomic<bool> const &rendered,
+        int interval, uint64_t configHash, const BoundingBox &bbox, uint64_t iterationCount) {
+
+    Timer timer;
+    while (!rendered) {
+        usleep(100*1000);
+
+        if (!rendered && timer.elapsed() >= interval) {
+            renderThreads.updateSnapshots();
+            if (!Checkpoint::write(CHECKPOINT_PATHNAME, configHash, bbox, iterationCount,
+                        renderThreads.snapshotStates, *renderThreads.snapshotTotal)) {
+
+                std::cerr << "Cannot write checkpoint.\n";
+            }
+            timer = Timer();
+        }
+    }
+}
+
+/**
+ * Accumulation file of a worker process.
+ */
+static std::string getWorkerPathname(int worker) {
+    return "out-worker" + std::to_string(worker) + ".acc";
+}
+
+/**
+ * Run this program again as "workerCount" worker processes with the same
+ * arguments, each rendering with its share of the threads and its own
+ * seeds, and wait for them. Stands in for running them on a cluster.
+ * Returns whether they all succeeded.
+ */
+static bool runWorkers(int argc, char *argv[], int workerCount) {
+    std::vector<pid_t> pids;
+
+    for (int worker = 0; worker < workerCount; worker++) {
+        std::vector<std::string> args;
+        for (int i = 0; i < argc; i++) {
+            if (std::string(argv[i]) == "--workers") {
+                i++;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+        args.push_back("--worker");
+        args.push_back(std::to_string(worker) + "/" + std::to_string(workerCount));
+
+        std::vector<char *> execArgs;
+        for (std::string &arg : args) {
+            execArgs.push_back(&arg[0]);
+        }
+        execArgs.push_back(nullptr);
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            execvp(execArgs[0], &execArgs[0]);
+            perror(execArgs[0]);
+            _exit(1);
+        }
+        pids.push_back(pid);
+    }
+
+    bool success = (int) pids.size() == workerCount;
+    for (pid_t pid : pids) {
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            success = false;
+        }
+    }
+    if (!success) {
+        std::cerr << "A worker failed." << std::endl;
+    }
+
+    return success;
+}
+
+/**
+ * Sum the accumulation files and save the result to "out.png", and to
+ * "out.acc" if "saveRaw" is set. Returns whether successful.
+ */
+static bool saveMerged(std::vector<std::string> const &pathnames, bool saveRaw,
+        ToneMapper const &toneMapper, int thread_count) {
+
+    std::cout << "Merging " << pathnames.size() << " accumulation files..." << std::endl;
+    AccumulationFile::Header header;
+    auto image = AccumulationFile::merge(pathnames, header, thread_count);
+    if (!image) {
+        return false;
+    }
+    std::cout << "Merged " << header.iterationCount << " iterations." << std::endl;
+
+    if (saveRaw && !AccumulationFile::write("out.acc", *image, header)) {
+        return false;
+    }
+    return toneMapper.save(*image, "out.png", thread_count);
+}
+
+/**
+ * Physical memory of this machine, in bytes.
+ */
+static uint64_t getPhysicalMemory() {
+    return (uint64_t) sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Render a fixed number of iterations at various resolutions with each
+ * accumulation mode, and print the memory used and the throughput.
+ */
+static void benchmark(TimeSlices const &timeSlices, const BoundingBox &bbox,
+        int thread_count) {
+
+    g_showProgress = false;
+
+    std::cout << std::setw(10) << "resolution" << std::setw(16) << "mode"
+        << std::setw(12) << "memory MB" << std::setw(12) << "render s"
+        << std::setw(12) << "merge s" << std::setw(12) << "Mpoints/s" << std::endl;
+
+    struct Mode {
+        const char *name;
+        Accumulation accumulation;
+        bool binSplats;
+    };
+    const Mode modes[] = {
+        { "per-thread", Accumulation::PER_THREAD, false },
+        { "per-thread+bin", Accumulation::PER_THREAD, true },
+        { "shared", Accumulation::SHARED, false },
+        { "shared+bin", Accumulation::SHARED, true },
+        { "banded", Accumulation::BANDED, false },
+        { "approximate", Accumulation::APPROXIMATE, false },
+    };
+
+    for (int resolution : BENCHMARK_RESOLUTIONS) {
+        for (Mode const &mode : modes) {
+            std::cout << std::setw(10) << resolution << std::setw(16) << mode.name;
+
+            // Per-thread images plus the final image, or one image plus the final.
+            uint64_t pixelBytes = (uint64_t) resolution*resolution*sizeof(uint32_t)*4;
+            uint64_t neededBytes;
+            switch (mode.accumulation) {
+                case Accumulation::PER_THREAD:
+                    neededBytes = pixelBytes*(thread_count + 1);
+                    break;
+
+                case Accumulation::APPROXIMATE:
+                    neededBytes = pixelBytes/4*thread_count + pixelBytes;
+                    break;
+
+                case Accumulation::BANDED:
+                    neededBytes = pixelBytes;
+                    break;
+
+                default:
+                    neededBytes = pixelBytes*2;
+                    break;
+            }
+            if (neededBytes > getPhysicalMemory()) {
+                std::cout << "  skipped, needs " << neededBytes/1024/1024 << " MB" << std::endl;
+                continue;
+            }
+
+            resetBinStats();
+            Timer renderTimer;
+            RenderThreads renderThreads;
+            renderThreads.start(mode.accumulation, mode.binSplats, resolution, resolution,
+                    timeSlices, bbox, BENCHMARK_ITERATIONS, thread_count);
+            renderThreads.join();
+            double renderTime = renderTimer.elapsed();
+
+            // Banded images are converted straight from their bands.
+            Timer mergeTimer;
+            std::unique_ptr<Image> image;
+            if (mode.accumulation != Accumulation::BANDED) {
+                image = std::make_unique<Image>(resolution, resolution);
+                renderThreads.addTo(*image);
+            }
+            double mergeTime = mergeTimer.elapsed();
+
+            uint64_t byteCount = (image ? image->getByteCount() : 0) +
+                renderThreads.getByteCount();
+            double totalTime = renderTime + mergeTime;
+            std::cout << std::fixed << std::setprecision(2)
+                << std::setw(12) << byteCount/1024.0/1024.0
+                << std::setw(12) << renderTime
+                << std::setw(12) << mergeTime
+                << std::setw(12) << BENCHMARK_ITERATIONS*thread_count/totalTime/1000000
+                << std::endl;
+            if (mode.binSplats) {
+                std::cout << std::setw(26) << "";
+                printBinStats();
+            }
+        }
+    }
+}
+
+/**
+ * Render a fixed number of iterations on this thread at various resolutions
+ * with each image layout, and print the time and the TLB and cache misses.
+ */
+static void benchmarkLayouts(TimeSlices const &timeSlices, const BoundingBox &bbox) {
+    g_showProgress = false;
+
+    PerfCounters perfCounters;
+    if (!perfCounters.isAvailable()) {
+        std::cout << "Hardware counters are not available, only showing times." << std::endl;
+    }
+
+    std::cout << std::setw(10) << "resolution" << std::setw(16) << "layout"
+        << std::setw(12) << "render s" << std::setw(12) << "export s"
+        << std::setw(12) << "memory MB" << std::setw(14) << "TLB miss/pt" << std::setw(14) << "cache miss/pt" << std::endl;
+
+    for (int resolution : BENCHMARK_RESOLUTIONS) {
+        for (Image::Layout layout : { Image::Layout::ROW_MAJOR, Image::Layout::TILED }) {
+            std::cout << std::setw(10) << resolution << std::setw(16)
+                << (layout == Image::Layout::TILED ? "tiled" : "row-major");
+
+            // Image plus the 8-bit copy.
+            uint64_t neededBytes = (uint64_t) resolution*resolution*(sizeof(uint32_t)*4 + 3);
+            if (neededBytes > getPhysicalMemory()) {
+                std::cout << "  skipped, needs " << neededBytes/1024/1024 << " MB" << std::endl;
+                continue;
+            }
+
+            Image image(resolution, resolution, layout);
+
+            Timer renderTimer;
+            perfCounters.start();
+            render(image, timeSlices, bbox, BENCHMARK_ITERATIONS, random());
+            perfCounters.stop();
+            double renderTime = renderTimer.elapsed();
+
+            // Only touched tiles are allocated.
+            uint64_t imageBytes = image.getByteCount();
+
+            Timer exportTimer;
+            std::vector<gamma_color> rgb;
+            image.brightenDarks();
+            image.toRgb(rgb);
+            double exportTime = exportTimer.elapsed();
+
+            std::cout << std::fixed << std::setprecision(2)
+                << std::setw(12) << renderTime
+                << std::setw(12) << exportTime
+                << std::setw(12) << imageBytes/1024/1024 << std::setprecision(4);
+            if (perfCounters.isAvailable()) {
+                std::cout
+                    << std::setw(14) << (double) perfCounters.getTlbMisses()/BENCHMARK_ITERATIONS
+                    << std::setw(14) << (double) perfCounters.getCacheMisses()/BENCHMARK_ITERATIONS;
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+/**
+ * Render an image too big for memory one band at a time, each band with a
+ * full set of iterations, and save it to the pathname as a PNG file.
+ * Returns whether successful.
+ */
+static bool renderOutOfCore(TimeSlices const &timeSlices, const BoundingBox &bbox,
+        int width, int height, uint64_t iterationCount, int thread_count,
+        const std::string &pathname) {
+
+    // The shared band and the image it's copied to, 16 bytes per pixel each,
+    // and no more pixels than an image can have.
+    uint64_t bandBytes = getPhysicalMemory()*OUT_OF_CORE_MEMORY_FRACTION;
+    uint64_t bandPixels = std::min(bandBytes/32, (uint64_t) Image::MAX_PIXEL_COUNT);
+    uint64_t paddedWidth =
+        ((uint64_t) width + Image::TILE_SIZE - 1)/Image::TILE_SIZE*Image::TILE_SIZE;
+    int bandHeight = bandPixels/paddedWidth/Image::TILE_SIZE*Image::TILE_SIZE;
+    if (bandHeight < Image::TILE_SIZE) {
+        bandHeight = Image::TILE_SIZE;
+    }
+
+    OutOfCoreImage outOfCoreImage(width, height, bandHeight);
+    if (!outOfCoreImage.create(pathname + ".scratch")) {
+        return false;
+    }
+
+    // Every band runs the same orbits, so the bands line up exactly.
+    std::vector<long> seeds;
+    for (int t = 0; t < thread_count; t++) {
+        seeds.push_back(random());
+    }
+
+    int bandCount = outOfCoreImage.getBandCount();
+    for (int band = 0; band < bandCount; band++) {
+        std::cout << "Rendering band " << (band + 1) << " of " << bandCount << "..." << std::endl;
+
+        // Points outside the band are out of bounds and dropped.
+        int firstRow = outOfCoreImage.getBandFirstRow(band);
+        int rowCount = outOfCoreImage.getBandRowCount(band);
+        SharedImage sharedImage(width, height, firstRow, rowCount);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; t++) {
+            threads.emplace_back(renderBinned<SharedImage>, std::ref(sharedImage),
+                    std::cref(timeSlices), std::cref(bbox), iterationCount, seeds[t]);
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        Image image(width, rowCount);
+        sharedImage.addTo(image, firstRow);
+        outOfCoreImage.storeBand(band, image);
+    }
+
+    std::cout << "Writing " << pathname << "..." << std::endl;
+    return outOfCoreImage.save(pathname);
+}
+
+/**
+ * Config "frame" of "frameCount" frames, with the keyframes spread evenly
+ * and the frames between them interpolated. Returns null on error.
+ */
+static std::unique_ptr<Config> interpolateFrame(std::vector<TimeSlices> const &keyframes,
+        int frame, int frameCount) {
+
+    double position = frameCount == 1 ? 0 :
+        (double) frame*(keyframes.size() - 1)/(frameCount - 1);
+    int keyframe = std::min((int) position, (int) keyframes.size() - 2);
+
+    if (keyframe < 0) {
+        // A single keyframe.
+        return keyframes[0][0]->interpolate(*keyframes[0][0], 0);
+    }
+
+    return keyframes[keyframe][0]->interpolate(*keyframes[keyframe + 1][0],
+            position - keyframe);
+}
+
+/**
+ * Sum, tone map and save a finished frame, to "out-NNNN.png" or to the
+ * YUV4MPEG2 stream if it's not null. Returns whether successful.
+ */
+static bool saveFrame(RenderThreads const &renderThreads, int frame, int width, int height,
+        ToneMapper const &toneMapper, int thread_count, Y4mWriter *y4mWriter) {
+
+    Image image(width, height);
+    double max = renderThreads.addTo(image);
+
+    if (y4mWriter != nullptr) {
+        std::vector<gamma_color> rgb;
+        toneMapper.toRgb(image, rgb, thread_count, max);
+        return y4mWriter->writeFrame(rgb);
+    }
+
+    std::ostringstream pathname;
+    pathname << "out-" << std::setfill('0') << std::setw(4) << frame << ".png";
+    return toneMapper.save(image, pathname.str(), thread_count, max);
+}
+
+/**
+ * Render an animation of "frameCount" frames through the keyframes. While
+ * one frame renders, the previous one is summed, tone mapped and encoded on
+ * another thread, so the render threads never wait for the encoder. All
+ * frames share a bounding box covering the keyframes, and their render
+ * threads start from the same seeds, so the noise doesn't flicker. Returns
+ * whether successful.
+ */
+static bool renderSequence(std::vector<TimeSlices> const &keyframes, int frameCount,
+        int width, int height, uint64_t iterationCount, int thread_count,
+        ToneMapper const &toneMapper,
+        const std::string &y4mPathname, int fps) {
+
+    for (unsigned k = 1; k < keyframes.size(); k++) {
+        if (!keyframes[k - 1][0]->interpolate(*keyframes[k][0], 0)) {
+            return false;
+        }
+    }
+
+    BoundingBox bbox;
+    for (TimeSlices const &keyframe : keyframes) {
+        bbox.grow(computeBoundingBox(keyframe));
+    }
+    bbox.makeSquare();
+
+    Y4mWriter y4mWriter;
+    if (!y4mPathname.empty() && !y4mWriter.open(y4mPathname, width, height, fps)) {
+        return false;
+    }
+
+    // A frame being encoded, with the config its render threads refer to.
+    struct Frame {
+        TimeSlices timeSlices;
+        RenderThreads renderThreads;
+    };
+
+    Timer timer;
+    std::unique_ptr<Frame> encodingFrame;
+    std::thread encoder;
+    // Only the encoder sets it, and only after joining it is it read.
+    bool encoded = true;
+    bool success = true;
+    long seed = random();
+    for (int frame = 0; frame < frameCount && success; frame++) {
+        std::cout << "Rendering frame " << (frame + 1) << " of " << frameCount
+            << "..." << std::endl;
+
+        auto config = interpolateFrame(keyframes, frame, frameCount);
+        if (!config) {
+            success = false;
+            break;
+        }
+
+        auto renderingFrame = std::make_unique<Frame>();
+        renderingFrame->timeSlices.push_back(std::move(config));
+        srandom(seed);
+        renderingFrame->renderThreads.start(Accumulation::PER_THREAD, false, width, height,
+                renderingFrame->timeSlices, bbox, iterationCount, thread_count);
+        renderingFrame->renderThreads.join();
+
+        // Frames go to the stream in order, one encoding at a time.
+        if (encoder.joinable()) {
+            encoder.join();
+            success = encoded;
+            if (!success) {
+                break;
+            }
+        }
+        encodingFrame = std::move(renderingFrame);
+        encoder = std::thread([&, frame]() {
+            encoded = saveFrame(encodingFrame->renderThreads, frame, width, height,
+                    toneMapper, thread_count, y4mPathname.empty() ? nullptr : &y4mWriter);
+        });
+    }
+    if (encoder.joinable()) {
+        encoder.join();
+        success = encoded && success;
+    }
+    success = y4mWriter.close() && success;
+
+    double elapsed = timer.elapsed();
+    std::cout << "Rendered " << frameCount << " frames in " << std::fixed
+        << std::setprecision(1) << elapsed << " seconds, "
+        << (elapsed > 0 ? frameCount*3600/elapsed : 0) << " frames per hour." << std::endl;
 
-    // Starting point.
-    double x = 0;
-    double y = 0;
+    return success;
+}
 
-    // Find the bounding box
-    // XXX do a better job of ignoring outliers. Fuse length isn't enough.
-    const int SAMPLE_COUNT = 10000;
-    std::vector<double> x_history(SAMPLE_COUNT);
-    std::vector<double> y_history(SAMPLE_COUNT);
-    for (int i = 0; i < FUSE_LENGTH + SAMPLE_COUNT; i++) {
-        if (i >= FUSE_LENGTH) {
-            x_history[i - FUSE_LENGTH] = x;
-            y_history[i - FUSE_LENGTH] = y;
-            bbox.grow(x, y);
+/**
+ * Contents of the config file after the color map name, or empty on error.
+ * Configs with the same shape differ at most in their color map.
+ */
+static std::string getConfigShape(const std::string &pathname) {
+    std::ifstream f(pathname);
+    std::string colorMapName;
+    f >> colorMapName;
+
+    std::stringstream shape;
+    shape << f.rdbuf();
+
+    return shape.str();
+}
+
+/**
+ * Save a banded render as out.png, and as float images if asked, straight
+ * from its bands rather than summing them into another image. Returns
+ * whether successful.
+ */
+static bool saveBanded(BandedImage const &image, ToneMapper const &toneMapper,
+        int thread_count, bool savePfm, bool saveExr, bool exrRle) {
+
+    std::cout << "Brightening darks..." << std::endl;
+    if (!toneMapper.save(image, "out.png", thread_count)) {
+        return false;
+    }
+
+    if (savePfm || saveExr) {
+        int width = image.getWidth();
+        int height = image.getHeight();
+        std::vector<float> linear;
+        toneMapper.toLinear(image, linear, thread_count);
+        return (!savePfm || HdrWriter::savePfm("out.pfm", width, height, linear)) &&
+            (!saveExr || HdrWriter::saveExr("out.exr", width, height, linear, exrRle));
+    }
+
+    return true;
+}
+
+/**
+ * Color the finished render with every color map, saving each to
+ * "out-<name>.png". Returns whether successful.
+ */
+static bool saveAllPalettes(RenderThreads const &renderThreads, ColorMaps const &colorMaps,
+        int width, int height, ToneMapper const &toneMapper, int thread_count) {
+
+    for (std::string const &name : colorMaps.getNames()) {
+        Timer timer;
+        Image image(width, height);
+        renderThreads.addTo(image, *colorMaps.get(name));
+        double elapsed = timer.elapsed();
+
+        std::string pathname = "out-" + name + ".png";
+        if (!toneMapper.save(image, pathname, thread_count)) {
+            return false;
         }
 
-        Attractor const &attractor = config.attractorSet().choose();
-        attractor.transform(x, y);
-        config.variations().transform(x, y);
+        std::cout << "Colored " << pathname << " in " << std::fixed
+            << std::setprecision(3) << elapsed << " seconds." << std::endl;
     }
 
-    bbox.growBy(0.05);  // 5% larger
-    bbox.makeSquare();
+    return true;
+}
 
-    std::cout << "Computed bounding box (strict): " << bbox << std::endl;
+/**
+ * Parse layer groups like "0+1,2" (attractors 0 and 1 in one layer and 2 in
+ * another) into the layer of each attractor. Attractors not in any group get
+ * a layer of their own. Returns the number of layers, or -1 on error.
+ */
+static int makeAttractorLayers(const std::string &groups, int attractorCount,
+        std::vector<int> &attractorLayers) {
 
-    std::sort(x_history.begin(), x_history.end());
-    std::sort(y_history.begin(), y_history.end());
+    attractorLayers.assign(attractorCount, -1);
+    int layerCount = 0;
 
-    const double PERCENTILE = 0.1;
-    const int skip = (int) (PERCENTILE*SAMPLE_COUNT/100 + 0.5);
-    bbox = BoundingBox(x_history[skip], y_history[skip],
-            x_history[SAMPLE_COUNT - skip - 1], y_history[SAMPLE_COUNT - skip - 1]);
-    bbox.growBy(0.15);
-    bbox.makeSquare();
-    std::cout << "Computed bounding box (percentile): " << bbox << std::endl;
+    std::istringstream s(groups);
+    std::string group;
+    while (std::getline(s, group, ',')) {
+        std::istringstream g(group);
+        std::string index;
+        while (std::getline(g, index, '+')) {
+            int attractorIndex;
+            std::istringstream i(index);
+            i >> attractorIndex;
+            if (!i || attractorIndex < 0 || attractorIndex >= attractorCount) {
+                std::cerr << "Invalid attractor index in layer groups: " << index << std::endl;
+                return -1;
+            }
+            attractorLayers[attractorIndex] = layerCount;
+        }
+        layerCount++;
+    }
 
-    return bbox;
+    for (int &layer : attractorLayers) {
+        if (layer == -1) {
+            layer = layerCount++;
+        }
+    }
+
+    return layerCount;
 }
 
-static void render(Image &image, Config const &config,
-        const BoundingBox &bbox, int seed) {
+/**
+ * Save each layer as "out-layer<n>.png", brightened by the counts of the
+ * whole image and normalized like it, so that they add up to it. The whole
+ * image must be finished and not brightened. Returns whether successful.
+ */
+static bool saveLayers(RenderThreads const &renderThreads, Image const &image,
+        ToneMapper const &toneMapper, int thread_count) {
 
-    // Initialize the seed for our thread.
-    init_rand(seed);
+    double max = toneMapper.getMax(image, thread_count);
 
-    // Color (0-1) in the color map.
-    double colorMapValue = 0;
+    for (int layer = 0; layer < renderThreads.layerCount; layer++) {
+        Image layerImage(image.getWidth(), image.getHeight());
+        renderThreads.addLayerTo(layerImage, layer);
 
-    // Starting point.
-    double x = 0;
-    double y = 0;
+        std::string pathname = "out-layer" + std::to_string(layer) + ".png";
+        if (!toneMapper.saveLayer(layerImage, image, pathname, thread_count, max)) {
+            return false;
+        }
 
-    for (uint64_t i = 0; !g_done && i < FEW_SECONDS_ITERATIONS; i++) {
-        Attractor const &attractor = config.attractorSet().choose();
-        attractor.transform(x, y);
-        config.variations().transform(x, y);
+        std::cout << "Saved " << pathname << " with attractors";
+        for (unsigned i = 0; i < renderThreads.attractorLayers.size(); i++) {
+            if (renderThreads.attractorLayers[i] == layer) {
+                std::cout << " " << i;
+            }
+        }
+        std::cout << "." << std::endl;
+    }
 
-        // Map to pixel.
-        int ix = (int) (bbox.normalizeX(x)*(WIDTH - 1) + 0.5);
-        int iy = (int) ((1 - bbox.normalizeY(y))*(HEIGHT- 1) + 0.5);
+    return true;
+}
 
-        // Move half-way to new color value.
-        double newColorMapValue = attractor.getColorMapValue();
-        colorMapValue = (colorMapValue + newColorMapValue)/2;
+/**
+ * Save "levelCount" smaller copies of the image, which must not have been
+ * brightened yet, as "out-mip<level>.png" at 1/2^level size. Returns whether
+ * successful.
+ */
+static bool saveMipLevels(Image const &image, int levelCount, ToneMapper const &toneMapper,
+        int thread_count) {
+
+    MipPyramid pyramid(image, levelCount, thread_count);
+
+    for (int level = 1; level <= pyramid.getLevelCount(); level++) {
+        std::string pathname = "out-mip" + std::to_string(level) + ".png";
+        if (!toneMapper.save(pyramid.getLevel(level), pathname, thread_count)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Parse a view like "0.4,0.1,0.6,0.3", "0.4,0.1,0.6,0.3@512" or
+ * "0.4,0.1,0.6,0.3@512x512": the left, top, right and bottom of a part of
+ * the full view, as fractions of it, and optionally the width or size of
+ * its image, which must be supported by Image. A missing size is the
+ * largest that fits in the full view, and a missing height follows from
+ * the width, so that the part isn't stretched. Returns whether successful.
+ */
+static bool parseView(const std::string &spec, Viewports::View const &fullView,
+        Viewports::View &view) {
 
-        if (image.isInBounds(ix, iy) && i >= FUSE_LENGTH) {
-            // Look up RGB color.
-            int colorIndex = (int) (colorMapValue*255 + 0.5);
+    double left, top, right, bottom;
+    char comma1, comma2, comma3;
+    std::istringstream s(spec);
+    s >> left >> comma1 >> top >> comma2 >> right >> comma3 >> bottom;
+    if (!s || comma1 != ',' || comma2 != ',' || comma3 != ',' ||
+            left >= right || top >= bottom) {
 
-            linear_color red, green, blue;
-            config.colorMap().getColor(colorIndex, red, green, blue);
-            image.touchPixel(ix, iy, red, green, blue);
+        return false;
+    }
+
+    // Size of the part in the full view's pixels.
+    double partWidth = (right - left)*fullView.width;
+    double partHeight = (bottom - top)*fullView.height;
+
+    char at;
+    if (s >> at) {
+        s >> view.width;
+        if (!s || at != '@' || view.width <= 0) {
+            return false;
+        }
+
+        char x;
+        if (s >> x) {
+            s >> view.height;
+            if (!s || x != 'x' || view.height <= 0) {
+                return false;
+            }
+        } else {
+            view.height = (int) std::max(1.0, partHeight*view.width/partWidth + 0.5);
         }
+    } else {
+        double scale = std::min(fullView.width/partWidth, fullView.height/partHeight);
+        view.width = (int) std::max(1.0, partWidth*scale + 0.5);
+        view.height = (int) std::max(1.0, partHeight*scale + 0.5);
+    }
+    if (!Image::isSizeSupported(view.width, view.height)) {
+        return false;
+    }
+
+    view.bbox = fullView.bbox.crop(left, top, right, bottom);
+
+    return true;
+}
+
+/**
+ * Save each view after the first as "out-view<n>.png", and print how many
+ * points landed in each. Returns whether successful.
+ */
+static bool saveViews(RenderThreads const &renderThreads, ToneMapper const &toneMapper,
+        int thread_count) {
+
+    for (unsigned view = 0; view < renderThreads.views.size(); view++) {
+        Viewports::View const &spec = renderThreads.views[view];
+        uint64_t hitCount = renderThreads.getViewHitCount(view);
+
+        std::cout << "View " << view << " (" << spec.width << "x" << spec.height
+            << "): " << hitCount
+            << " points, " << std::fixed << std::setprecision(1)
+            << (double) hitCount/((uint64_t) spec.width*spec.height)
+            << " per pixel." << std::endl;
+
+        if (view > 0) {
+            Image image(spec.width, spec.height);
+            renderThreads.addViewTo(image, view);
 
-        if (!INTERACTIVE && i % ITERATION_UPDATE == 0 && i != 0) {
-            std::cout << (i*100/FEW_SECONDS_ITERATIONS) << "%" << std::endl;
+            std::string pathname = "out-view" + std::to_string(view) + ".png";
+            if (!toneMapper.save(image, pathname, thread_count)) {
+                return false;
+            }
         }
     }
+
+    return true;
+}
+
+static void usage() {
+    std::cerr << "Usage: ifs [--motion-blur end.config] [--accumulation per-thread|shared|banded|approximate|palette] "
+        "[--bin-splats] [--all-palettes] [--layers] [--layer-groups 0+1,2] "
+        "[--mip-levels N] [--view LEFT,TOP,RIGHT,BOTTOM[@WIDTH[xHEIGHT]]]... "
+        "[--zoom LEFT,TOP,RIGHT,BOTTOM[@WIDTH[xHEIGHT]]] "
+        "[--supersample N] [--filter box|tent|lanczos] [--density-radius R] "
+        "[--exposure E] [--gamma G] [--vibrancy V] [--png-level store|fast|default|small] "
+        "[--raw] [--pfm] [--exr none|rle] [--deep-zoom] "
+        "[--frames N] [--keyframe next.config]... [--y4m out.y4m|-] [--fps N] "
+        "[--iterations N] [--checkpoint SECONDS] [--resume] [--workers N] "
+        "[--size WIDTHxHEIGHT] [--out-of-core] [--benchmark] in.config" << std::endl;
+    std::cerr << "       ifs [--exposure E] [--gamma G] [--vibrancy V] "
+        "--merge in.acc [--merge in.acc]..." << std::endl;
 }
 
 int main(int argc, char *argv[]) {
     std::string configPathname;
-    if (argc != 2) {
-        std::cerr << "Usage: ifs in.config" << std::endl;
+    std::string motionBlurPathname;
+    Accumulation accumulation = Accumulation::PER_THREAD;
+    bool binSplats = false;
+    bool runBenchmark = false;
+    int width = WIDTH;
+    int height = HEIGHT;
+    bool outOfCore = false;
+    bool allPalettes = false;
+    std::string layerGroups;
+    int mipLevelCount = 0;
+    std::vector<std::string> viewSpecs;
+    std::string zoomSpec;
+    int supersample = 1;
+    Downsampler::Filter filter = Downsampler::Filter::TENT;
+    double densityRadius = 0;
+    ToneMapper::Settings toneSettings;
+    bool saveRaw = false;
+    bool savePfm = false;
+    bool saveExr = false;
+    bool exrRle = false;
+    bool deepZoom = false;
+    int frameCount = 0;
+    std::vector<std::string> keyframePathnames;
+    std::string y4mPathname;
+    int fps = 30;
+    uint64_t iterationCount = FEW_SECONDS_ITERATIONS;
+    int checkpointInterval = 0;
+    bool resume = false;
+    std::vector<std::string> mergePathnames;
+    int workerCount = 0;
+    // Index of this worker process, and how many there are, or -1.
+    int workerIndex = -1;
+    int workerTotal = 0;
+    // Layers are accumulated per thread, in a mode of their own.
+    bool layers = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--motion-blur" && i + 1 < argc) {
+            // Config at shutter close; the main config is at shutter open.
+            motionBlurPathname = argv[++i];
+        } else if (arg == "--accumulation" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "per-thread") {
+                accumulation = Accumulation::PER_THREAD;
+            } else if (mode == "shared") {
+                accumulation = Accumulation::SHARED;
+            } else if (mode == "banded") {
+                accumulation = Accumulation::BANDED;
+            } else if (mode == "approximate") {
+                accumulation = Accumulation::APPROXIMATE;
+            } else if (mode == "palette") {
+                accumulation = Accumulation::PALETTE;
+            } else {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--bin-splats") {
+            binSplats = true;
+        } else if (arg == "--size" && i + 1 < argc) {
+            char x;
+            std::istringstream size(argv[++i]);
+            size >> width >> x >> height;
+            if (!size || x != 'x' || width <= 0 || height <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--layers") {
+            layers = true;
+        } else if (arg == "--layer-groups" && i + 1 < argc) {
+            layers = true;
+            layerGroups = argv[++i];
+        } else if (arg == "--mip-levels" && i + 1 < argc) {
+            std::istringstream levels(argv[++i]);
+            levels >> mipLevelCount;
+            if (!levels || mipLevelCount <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--view" && i + 1 < argc) {
+            viewSpecs.push_back(argv[++i]);
+        } else if (arg == "--zoom" && i + 1 < argc) {
+            zoomSpec = argv[++i];
+        } else if (arg == "--supersample" && i + 1 < argc) {
+            std::istringstream factor(argv[++i]);
+            factor >> supersample;
+            if (!factor || supersample <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--filter" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "box") {
+                filter = Downsampler::Filter::BOX;
+            } else if (name == "tent") {
+                filter = Downsampler::Filter::TENT;
+            } else if (name == "lanczos") {
+                filter = Downsampler::Filter::LANCZOS;
+            } else {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--density-radius" && i + 1 < argc) {
+            std::istringstream radius(argv[++i]);
+            radius >> densityRadius;
+            if (!radius || densityRadius <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--exposure" && i + 1 < argc) {
+            std::istringstream exposure(argv[++i]);
+            exposure >> toneSettings.exposure;
+            if (!exposure || toneSettings.exposure <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--gamma" && i + 1 < argc) {
+            std::istringstream gamma(argv[++i]);
+            gamma >> toneSettings.gamma;
+            if (!gamma || toneSettings.gamma <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--vibrancy" && i + 1 < argc) {
+            std::istringstream vibrancy(argv[++i]);
+            vibrancy >> toneSettings.vibrancy;
+            if (!vibrancy || toneSettings.vibrancy < 0 || toneSettings.vibrancy > 1) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--png-level" && i + 1 < argc) {
+            std::string level = argv[++i];
+            if (level == "store") {
+                PngWriter::defaultLevel() = PngWriter::Level::STORE;
+            } else if (level == "fast") {
+                PngWriter::defaultLevel() = PngWriter::Level::FAST;
+            } else if (level == "default") {
+                PngWriter::defaultLevel() = PngWriter::Level::DEFAULT;
+            } else if (level == "small") {
+                PngWriter::defaultLevel() = PngWriter::Level::SMALL;
+            } else {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--raw") {
+            saveRaw = true;
+        } else if (arg == "--pfm") {
+            savePfm = true;
+        } else if (arg == "--exr" && i + 1 < argc) {
+            std::string compression = argv[++i];
+            if (compression != "none" && compression != "rle") {
+                usage();
+                return -1;
+            }
+            saveExr = true;
+            exrRle = compression == "rle";
+        } else if (arg == "--deep-zoom") {
+            deepZoom = true;
+        } else if (arg == "--frames" && i + 1 < argc) {
+            std::istringstream frames(argv[++i]);
+            frames >> frameCount;
+            if (!frames || frameCount <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--keyframe" && i + 1 < argc) {
+            // Keyframes after the main config, spread evenly over the frames.
+            keyframePathnames.push_back(argv[++i]);
+        } else if (arg == "--y4m" && i + 1 < argc) {
+            y4mPathname = argv[++i];
+        } else if (arg == "--fps" && i + 1 < argc) {
+            std::istringstream rate(argv[++i]);
+            rate >> fps;
+            if (!rate || fps <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            // Per thread.
+            std::istringstream iterations(argv[++i]);
+            iterations >> iterationCount;
+            if (!iterations || iterationCount == 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            std::istringstream interval(argv[++i]);
+            interval >> checkpointInterval;
+            if (!interval || checkpointInterval <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--merge" && i + 1 < argc) {
+            mergePathnames.push_back(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            std::istringstream workers(argv[++i]);
+            workers >> workerCount;
+            if (!workers || workerCount <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--worker" && i + 1 < argc) {
+            // Added by the coordinator as "index/count".
+            char slash;
+            std::istringstream worker(argv[++i]);
+            worker >> workerIndex >> slash >> workerTotal;
+            if (!worker || slash != '/' || workerIndex < 0 || workerIndex >= workerTotal) {
+                usage();
+                return -1;
+            }
+        } else if (arg == "--all-palettes") {
+            allPalettes = true;
+        } else if (arg == "--out-of-core") {
+            outOfCore = true;
+        } else if (arg == "--benchmark") {
+            runBenchmark = true;
+        } else if (arg[0] != '-' && configPathname.empty()) {
+            configPathname = arg;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    if (configPathname.empty() && mergePathnames.empty()) {
+        usage();
+        return -1;
+    }
+    if (layers) {
+        if (accumulation != Accumulation::PER_THREAD) {
+            std::cerr << "Layers only work with per-thread accumulation." << std::endl;
+            return -1;
+        }
+        accumulation = Accumulation::LAYERED;
+    }
+    if (!viewSpecs.empty()) {
+        if (accumulation != Accumulation::PER_THREAD) {
+            std::cerr << "Views only work with per-thread accumulation." << std::endl;
+            return -1;
+        }
+        accumulation = Accumulation::VIEWPORTS;
+    }
+    if (supersample > 1 && (outOfCore || mipLevelCount > 0 || allPalettes ||
+                accumulation == Accumulation::LAYERED || accumulation == Accumulation::VIEWPORTS)) {
+
+        std::cerr << "Supersampling only works with plain images." << std::endl;
+        return -1;
+    }
+    if (densityRadius > 0 && (supersample > 1 || outOfCore || mipLevelCount > 0 ||
+                allPalettes || accumulation == Accumulation::LAYERED ||
+                accumulation == Accumulation::VIEWPORTS)) {
+
+        std::cerr << "Density estimation only works with plain images." << std::endl;
+        return -1;
+    }
+
+    if ((saveRaw || savePfm || saveExr) && outOfCore) {
+        std::cerr << "Raw and float images don't work with --out-of-core." << std::endl;
+        return -1;
+    }
+    if ((savePfm || saveExr) && (supersample > 1 || densityRadius > 0)) {
+        std::cerr << "Float images don't work with supersampling or density estimation."
+            << std::endl;
+        return -1;
+    }
+    if (deepZoom && (outOfCore || supersample > 1 || densityRadius > 0)) {
+        std::cerr << "Deep zoom tiles only work with plain images." << std::endl;
+        return -1;
+    }
+    if (accumulation == Accumulation::BANDED && (supersample > 1 || densityRadius > 0 ||
+                mipLevelCount > 0 || allPalettes || saveRaw || deepZoom ||
+                workerCount > 0 || workerIndex >= 0)) {
+
+        std::cerr << "Banded images are saved straight from their bands, "
+            "so only as PNG and float images." << std::endl;
+        return -1;
+    }
+    if ((!keyframePathnames.empty() || !y4mPathname.empty()) && frameCount == 0) {
+        std::cerr << "Keyframes and --y4m need --frames." << std::endl;
+        return -1;
+    }
+    if (frameCount > 0 && (INTERACTIVE || runBenchmark || outOfCore ||
+                !motionBlurPathname.empty() || accumulation != Accumulation::PER_THREAD ||
+                binSplats || !zoomSpec.empty() || supersample > 1 || densityRadius > 0 ||
+                mipLevelCount > 0 || allPalettes || saveRaw || savePfm || saveExr || deepZoom)) {
+
+        std::cerr << "Sequences only work with plain images in batch mode." << std::endl;
+        return -1;
+    }
+    // Checkpoints are written at the end, and every so often if asked.
+    bool checkpoints = checkpointInterval > 0 || resume;
+    if (checkpoints && (INTERACTIVE || runBenchmark || outOfCore || frameCount > 0 ||
+                accumulation != Accumulation::PER_THREAD || binSplats || !zoomSpec.empty())) {
+
+        std::cerr << "Checkpoints only work with plain per-thread images in batch mode."
+            << std::endl;
+        return -1;
+    }
+    if ((workerCount > 0 || workerIndex >= 0) && (INTERACTIVE || runBenchmark || outOfCore ||
+                frameCount > 0 || checkpoints || !zoomSpec.empty() ||
+                accumulation == Accumulation::LAYERED || accumulation == Accumulation::VIEWPORTS ||
+                supersample > 1 || densityRadius > 0 || mipLevelCount > 0 || allPalettes ||
+                savePfm || saveExr || deepZoom)) {
+
+        std::cerr << "Workers only work with plain images in batch mode." << std::endl;
+        return -1;
+    }
+    if (INTERACTIVE && !runBenchmark && !outOfCore &&
+            accumulation != Accumulation::PER_THREAD && accumulation != Accumulation::SHARED &&
+            accumulation != Accumulation::PALETTE) {
+
+        // The others are written by their threads as the preview reads them.
+        std::cerr << "The preview only works with per-thread, shared and palette accumulation."
+            << std::endl;
+        return -1;
+    }
+    if (INTERACTIVE && !outOfCore && (saveRaw || savePfm || saveExr || deepZoom ||
+                mipLevelCount > 0 || allPalettes || supersample > 1 || densityRadius > 0)) {
+
+        // The preview never reaches the end of the render, where they're saved.
+        std::cerr << "These outputs are only saved in batch mode." << std::endl;
+        return -1;
+    }
+    if (INTERACTIVE && !outOfCore && iterationCount != FEW_SECONDS_ITERATIONS) {
+        std::cerr << "The preview has no iteration count." << std::endl;
+        return -1;
+    }
+    // Out-of-core renders have no preview to quit from, so they must end.
+    if (outOfCore && iterationCount == FEW_SECONDS_ITERATIONS) {
+        iterationCount = BATCH_ITERATIONS;
+    }
+    if (y4mPathname == "-") {
+        // The stream goes to standard output, so messages go to standard error.
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    if (outOfCore && (toneSettings.exposure != 1 || toneSettings.gamma != 2 ||
+                toneSettings.vibrancy != 0)) {
+
+        std::cerr << "Exposure settings don't work with --out-of-core." << std::endl;
+        return -1;
+    }
+
+    // Out-of-core renders only need a band of the image in memory.
+    if (outOfCore ? !Image::isSizeSupported(width, Image::TILE_SIZE)
+            : !Image::isSizeSupported((int64_t) width*supersample, (int64_t) height*supersample)) {
+
+        std::cerr << "The image is too large"
+            << (outOfCore ? "." : ", try --out-of-core.") << std::endl;
         return -1;
     }
-    configPathname = argv[1];
 
     // Number of threads to use.
     int thread_count = std::thread::hardware_concurrency();
     std::cout << "Using " << thread_count << " threads.\n";
 
+    // Exposure of the preview and saved images.
+    ToneMapper toneMapper(toneSettings);
+
+    if (!mergePathnames.empty()) {
+        return saveMerged(mergePathnames, true, toneMapper, thread_count) ? 0 : -1;
+    }
+    if (workerCount > 0) {
+        // Shard the render across processes, then sum their images.
+        std::vector<std::string> workerPathnames;
+        for (int worker = 0; worker < workerCount; worker++) {
+            workerPathnames.push_back(getWorkerPathname(worker));
+        }
+
+        bool success = runWorkers(argc, argv, workerCount) &&
+            saveMerged(workerPathnames, saveRaw, toneMapper, thread_count);
+        for (std::string const &workerPathname : workerPathnames) {
+            unlink(workerPathname.c_str());
+        }
+        return success ? 0 : -1;
+    }
+    if (workerIndex >= 0) {
+        // Our share of the threads, with our own seeds.
+        thread_count = std::max(1, thread_count/workerTotal);
+        srandom(workerIndex + 1);
+    }
+
     // Load all color maps.
     ColorMaps colorMaps;
     bool success = colorMaps.read("ColorMap.txt");
@@ -135,8 +1924,8 @@ int main(int argc, char *argv[]) {
     }
 
 #ifdef DISPLAY
-    if (INTERACTIVE) {
-        if (!mfb_open("ifs", WIDTH, HEIGHT)) {
+    if (INTERACTIVE && !runBenchmark && !outOfCore) {
+        if (!mfb_open("ifs", width, height)) {
             std::cerr << "Failed to open the display.\n";
             return -1;
         }
@@ -155,35 +1944,197 @@ int main(int argc, char *argv[]) {
             return -1;
         }
 
+        if (frameCount > 0) {
+            std::vector<TimeSlices> keyframes(1);
+            keyframes[0].push_back(std::move(config));
+            for (std::string const &keyframePathname : keyframePathnames) {
+                auto keyframe = Config::load(keyframePathname, colorMaps);
+                if (!keyframe) {
+                    return -1;
+                }
+                keyframes.emplace_back();
+                keyframes.back().push_back(std::move(keyframe));
+            }
+
+            success = renderSequence(keyframes, frameCount, width, height, iterationCount,
+                    thread_count, toneMapper, y4mPathname, fps);
+            if (!success) {
+                std::cerr << "Cannot write output sequence.\n";
+                return -1;
+            }
+            return 0;
+        }
+
+        // Interpolate towards the shutter-close config for motion blur.
+        TimeSlices timeSlices;
+        if (motionBlurPathname.empty()) {
+            timeSlices.push_back(std::move(config));
+        } else {
+            auto endConfig = Config::load(motionBlurPathname, colorMaps);
+            if (!endConfig) {
+                return -1;
+            }
+
+            timeSlices = makeTimeSlices(*config, *endConfig);
+            if (timeSlices.empty()) {
+                return -1;
+            }
+        }
+
         // Compute bounding box.
-        BoundingBox bbox = computeBoundingBox(*config);
+        BoundingBox bbox = computeBoundingBox(timeSlices);
+
+        if (runBenchmark) {
+            benchmark(timeSlices, bbox, thread_count);
+            benchmarkLayouts(timeSlices, bbox);
+            return 0;
+        }
+
+        if (outOfCore) {
+            success = renderOutOfCore(timeSlices, bbox, width, height, iterationCount,
+                    thread_count, "out.png");
+            if (!success) {
+                std::cerr << "Cannot write output image.\n";
+                return -1;
+            }
+            return 0;
+        }
 
         // Generate the image on multiple threads.
-        std::vector<std::thread> threads;
-        std::vector<std::unique_ptr<Image>> images;
-        for (int t = 0; t < thread_count; t++) {
-            images.emplace_back(std::make_unique<Image>(WIDTH, HEIGHT));
-            threads.emplace_back(render, std::ref(*images.back()),
-                    std::cref(*config), std::cref(bbox), random());
+        RenderThreads renderThreads;
+
+        // Checkpoints are only resumed, and accumulation files merged,
+        // with the same configs.
+        uint64_t configHash = Config::getFileHash(configPathname);
+        if (!motionBlurPathname.empty()) {
+            configHash = Config::getFileHash(motionBlurPathname, configHash);
+        }
+        if (configHash == 0) {
+            return -1;
+        }
+        if (resume) {
+            auto checkpoint = Checkpoint::read(CHECKPOINT_PATHNAME);
+            if (!checkpoint) {
+                return -1;
+            }
+            if (checkpoint->getConfigHash() != configHash) {
+                std::cerr << "The checkpoint is of a different config." << std::endl;
+                return -1;
+            }
+            auto image = checkpoint->takeImage();
+            if (image->getWidth() != width*supersample || image->getHeight() != height*supersample) {
+                std::cerr << "The checkpoint is of a different size." << std::endl;
+                return -1;
+            }
+
+            // Continue each thread's orbit where it left off.
+            uint64_t doneCount = 0;
+            for (RenderState const &state : checkpoint->getStates()) {
+                doneCount += state.iteration;
+            }
+            std::cout << "Resuming after " << doneCount << " iterations." << std::endl;
+
+            bbox = checkpoint->getBbox();
+            thread_count = checkpoint->getStates().size();
+            renderThreads.snapshotTotal = std::move(image);
+            renderThreads.snapshotStates = checkpoint->getStates();
+        }
+
+        // Render only the zoomed part of the full view, at its own size.
+        std::unique_ptr<AddressPrefixes> zoomPrefixes;
+        if (!zoomSpec.empty()) {
+            Viewports::View view;
+            if (!parseView(zoomSpec, Viewports::View{ bbox, width, height }, view)) {
+                std::cerr << "Invalid zoom: " << zoomSpec << std::endl;
+                return -1;
+            }
+            if (!Image::isSizeSupported((int64_t) view.width*supersample,
+                        (int64_t) view.height*supersample)) {
+
+                std::cerr << "The zoomed image is too large." << std::endl;
+                return -1;
+            }
+            if (accumulation != Accumulation::PER_THREAD || timeSlices.size() != 1) {
+                std::cerr << "Zooming only works with per-thread accumulation "
+                    "and without motion blur." << std::endl;
+                return -1;
+            }
+
+            // Grow the zoomed part to the shape of the image it's drawn into,
+            // the preview window or the output, with pixels shaped like those
+            // of the full view, so that it isn't stretched.
+            int zoomWidth = INTERACTIVE ? width : view.width;
+            int zoomHeight = INTERACTIVE ? height : view.height;
+            double pixelAspect = bbox.getHeight()*width/(bbox.getWidth()*height);
+            view.bbox.growToAspect((double) zoomHeight/zoomWidth*pixelAspect);
+
+            zoomPrefixes = AddressPrefixes::make(*timeSlices[0], view.bbox);
+            if (!zoomPrefixes) {
+                return -1;
+            }
+            std::cout << "Zooming with " << zoomPrefixes->getCount()
+                << " address prefixes covering " << std::setprecision(3)
+                << zoomPrefixes->getProbability()*100 << "% of the points." << std::endl;
+
+            // The preview window keeps its size.
+            bbox = view.bbox;
+            if (!INTERACTIVE) {
+                width = view.width;
+                height = view.height;
+            }
+            renderThreads.zoomPrefixes = zoomPrefixes.get();
+        }
+        if (accumulation == Accumulation::LAYERED) {
+            renderThreads.layerCount = makeAttractorLayers(layerGroups,
+                    timeSlices[0]->attractorSet().getCount(), renderThreads.attractorLayers);
+            if (renderThreads.layerCount == -1) {
+                return -1;
+            }
+        }
+        if (accumulation == Accumulation::VIEWPORTS) {
+            renderThreads.views.push_back(Viewports::View{ bbox, width, height });
+            for (std::string const &viewSpec : viewSpecs) {
+                Viewports::View view;
+                if (!parseView(viewSpec, renderThreads.views[0], view)) {
+                    std::cerr << "Invalid view: " << viewSpec << std::endl;
+                    return -1;
+                }
+                renderThreads.views.push_back(view);
+            }
         }
+        // The preview and checkpoints only sum what's new since the last time.
+        renderThreads.snapshots = (INTERACTIVE && (accumulation == Accumulation::PER_THREAD ||
+                    accumulation == Accumulation::PALETTE)) || checkpoints;
+        renderThreads.start(accumulation, binSplats, width*supersample, height*supersample,
+                timeSlices, bbox, iterationCount, thread_count);
 
         if (INTERACTIVE) {
+            // Palette renders are recolored when only the color map changes.
+            uint64_t configFileTime = timeSlices[0]->fileTime();
+            std::string configShape = getConfigShape(configPathname);
+            std::unique_ptr<Config> recolorConfig;
+            std::vector<gamma_color> bgra;
+
             while (!g_done) {
                 // Time this update work.
                 Timer timer;
 
-                // Blend images.
-                Image image(WIDTH, HEIGHT);
-                for (int t = 0; t < thread_count; t++) {
-                    image.add(*images[t]);
-                }
-
-                // Simulate film exposure.
-                image.brightenDarks();
+                if (renderThreads.snapshotTotal) {
+                    // Only convert again when there's something new.
+                    if (renderThreads.updateSnapshots() || bgra.empty()) {
+                        toneMapper.toBgra(*renderThreads.snapshotTotal, bgra, thread_count);
+                    }
+                } else {
+                    // Blend images, with the palette deltas so far.
+                    renderThreads.updateSnapshots();
+                    Image image(width, height);
+                    double max = recolorConfig
+                        ? renderThreads.addTo(image, recolorConfig->colorMap())
+                        : renderThreads.addTo(image);
 
-                // Convert to 8-bit.
-                std::vector<gamma_color> bgra;
-                image.toBgra(bgra);
+                    // Simulate film exposure and convert to 8-bit.
+                    toneMapper.toBgra(image, bgra, thread_count, max);
+                }
 
                 int state = mfb_update(&bgra[0]);
                 if (state < 0) {
@@ -200,30 +2151,121 @@ int main(int argc, char *argv[]) {
                     usleep(200*1000);
 
                     uint64_t fileTime = Config::getFileTime(configPathname);
-                    if (fileTime != 0 && fileTime != config->fileTime()) {
-                        std::cout << "Reloading config file." << std::endl;
-                        g_done = true;
+                    if (fileTime != 0 && fileTime != configFileTime) {
+                        configFileTime = fileTime;
+
+                        auto newConfig = accumulation == Accumulation::PALETTE &&
+                            getConfigShape(configPathname) == configShape
+                            ? Config::load(configPathname, colorMaps) : nullptr;
+                        if (newConfig) {
+                            std::cout << "Recoloring." << std::endl;
+                            recolorConfig = std::move(newConfig);
+                        } else {
+                            std::cout << "Reloading config file." << std::endl;
+                            g_done = true;
+                        }
                     }
                 }
             }
 
             // Wait for threads to finish.
-            for (int t = 0; t < thread_count; t++) {
-                threads[t].join();
-            }
+            renderThreads.join();
         } else {
             // Wait for worker threads to quit, then blend images.
-            Image image(WIDTH, HEIGHT);
-            for (int t = 0; t < thread_count; t++) {
-                threads[t].join();
-                image.add(*images[t]);
+            std::atomic<bool> rendered(false);
+            std::thread checkpointer;
+            if (checkpointInterval > 0) {
+                checkpointer = std::thread(writeCheckpoints, std::ref(renderThreads),
+                        std::cref(rendered), checkpointInterval, configHash,
+                        std::cref(bbox), iterationCount);
+            }
+            renderThreads.join();
+            rendered = true;
+            if (checkpointer.joinable()) {
+                checkpointer.join();
+            }
+            if (renderThreads.bandedImage) {
+                success = saveBanded(*renderThreads.bandedImage, toneMapper, thread_count,
+                        savePfm, saveExr, exrRle);
+                if (!success) {
+                    std::cerr << "Cannot write output image.\n";
+                    return -1;
+                }
+                return 0;
             }
 
-            std::cout << "Brightening darks..." << std::endl;
-            image.brightenDarks();
+            Image image(width*supersample, height*supersample);
+            double max = renderThreads.addTo(image);
+
+            AccumulationFile::Header header;
+            header.configHash = configHash;
+            header.bbox = bbox;
+            header.iterationCount = iterationCount*thread_count;
+            if (workerIndex >= 0) {
+                // The coordinator merges and saves the workers' renders.
+                return AccumulationFile::write(getWorkerPathname(workerIndex), image, header)
+                    ? 0 : -1;
+            }
+
+            if (checkpoints) {
+                // The finished render, so that iterations can be added later.
+                std::cout << "Writing checkpoint..." << std::endl;
+                if (!Checkpoint::write(CHECKPOINT_PATHNAME, configHash, bbox, iterationCount,
+                            renderThreads.getFinalStates(), image)) {
+
+                    std::cerr << "Cannot write checkpoint.\n";
+                    return -1;
+                }
+            }
+            if (binSplats) {
+                printBinStats();
+            }
 
-            // Save the final image.
-            success = image.save("out.png");
+            // Shrink before brightening so that each size is brightened
+            // on its own.
+            success = mipLevelCount == 0 || saveMipLevels(image, mipLevelCount, toneMapper, thread_count);
+
+            if (supersample > 1) {
+                // Filter the counts before brightening.
+                std::cout << "Downsampling..." << std::endl;
+                Downsampler downsampler(image, supersample, filter);
+                success = success && downsampler.save("out.png", toneMapper, thread_count);
+            } else if (densityRadius > 0) {
+                // Spread sparse pixels before brightening.
+                std::cout << "Estimating density..." << std::endl;
+                DensityEstimator densityEstimator(image, densityRadius);
+                success = success && densityEstimator.save("out.png", toneMapper, thread_count);
+            } else {
+                // Save the final image.
+                std::cout << "Brightening darks..." << std::endl;
+                success = success && toneMapper.save(image, "out.png", thread_count, max);
+            }
+            if (success && saveRaw) {
+                // The counts and sums, at the rendered size.
+                success = AccumulationFile::write("out.acc", image, header);
+            }
+            if (success && (savePfm || saveExr)) {
+                std::vector<float> linear;
+                toneMapper.toLinear(image, linear, thread_count, max);
+                success = (!savePfm || HdrWriter::savePfm("out.pfm", width, height, linear)) &&
+                    (!saveExr || HdrWriter::saveExr("out.exr", width, height, linear, exrRle));
+            }
+            if (success && deepZoom) {
+                // Tiles straight from the counts, for pan and zoom viewers.
+                std::cout << "Saving deep zoom tiles..." << std::endl;
+                DeepZoomWriter deepZoomWriter(toneMapper, thread_count);
+                success = deepZoomWriter.save(image, "out", max);
+            }
+            if (success && allPalettes) {
+                success = saveAllPalettes(renderThreads, colorMaps, width, height,
+                        toneMapper, thread_count);
+            }
+            if (success && accumulation == Accumulation::LAYERED) {
+                success = saveLayers(renderThreads, image, toneMapper, thread_count);
+            }
+            if (success && accumulation == Accumulation::VIEWPORTS) {
+                success = saveViews(renderThreads, toneMapper, thread_count);
+            }
             if (!success) {
                 std::cerr << "Cannot write output image.\n";
             }
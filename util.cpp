@@ -18,3 +18,15 @@ double my_randd() {
 long my_randl() {
     return nrand48(g_xsubi);
 }
+
+void get_rand_state(unsigned short state[3]) {
+    state[0] = g_xsubi[0];
+    state[1] = g_xsubi[1];
+    state[2] = g_xsubi[2];
+}
+
+void set_rand_state(const unsigned short state[3]) {
+    g_xsubi[0] = state[0];
+    g_xsubi[1] = state[1];
+    g_xsubi[2] = state[2];
+}
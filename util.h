@@ -17,4 +17,9 @@ double my_randd();
 // [0, 2**31)
 long my_randl();
 
+// Copy the 48-bit state of this thread's generator out of or into "state",
+// to continue its sequence later.
+void get_rand_state(unsigned short state[3]);
+void set_rand_state(const unsigned short state[3]);
+
 #endif // UTIL_H